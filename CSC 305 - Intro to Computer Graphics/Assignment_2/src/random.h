@@ -0,0 +1,55 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <array>
+#include <cstdint>
+
+// Counter-based random numbers (Philox4x32-10, Salmon et al. 2011).
+// Every value is a pure function of its (key, counter) pair, so a pixel draws the same
+// numbers no matter which thread renders it or in what order the pixels are visited.
+
+typedef std::array<uint32_t, 4> philox_counter;
+typedef std::array<uint32_t, 2> philox_key;
+
+philox_counter philox4x32(philox_counter ctr, philox_key key) {
+	const uint32_t M0 = 0xD2511F53, M1 = 0xCD9E8D57;  // round multipliers
+	const uint32_t W0 = 0x9E3779B9, W1 = 0xBB67AE85;  // key schedule (Weyl sequence)
+
+	for (int round = 0; round < 10; ++round) {
+		const uint64_t p0 = uint64_t(M0) * ctr[0];
+		const uint64_t p1 = uint64_t(M1) * ctr[2];
+		ctr = {{ uint32_t(p1 >> 32) ^ ctr[1] ^ key[0], uint32_t(p1),
+			 uint32_t(p0 >> 32) ^ ctr[3] ^ key[1], uint32_t(p0) }};
+		key[0] += W0;
+		key[1] += W1;
+	}
+	return ctr;
+}
+
+// One stream of uniforms per (pixel, sample, bounce); the last counter word walks the stream.
+typedef struct {
+	philox_counter counter;
+	philox_key key;
+	philox_counter block;
+	int used;
+} sample_stream;
+
+sample_stream make_sample_stream(uint32_t pixel, uint32_t sample, uint32_t bounce, uint32_t seed = 0) {
+	sample_stream stream;
+	stream.counter = {{ pixel, sample, bounce, 0 }};
+	stream.key = {{ seed, 0x5EED305u }};
+	stream.used = 4;                                     // forces a block on the first draw
+	return stream;
+}
+
+// Uniform double in [0, 1)
+double next_uniform(sample_stream& stream) {
+	if (stream.used == 4) {
+		stream.block = philox4x32(stream.counter, stream.key);
+		++stream.counter[3];
+		stream.used = 0;
+	}
+	return stream.block[stream.used++] * (1.0 / 4294967296.0);
+}
+
+#endif
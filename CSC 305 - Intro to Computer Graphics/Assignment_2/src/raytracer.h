@@ -0,0 +1,506 @@
+#ifndef RAYTRACER_H
+#define RAYTRACER_H
+
+#include "utils.h"
+#include "random.h"
+#include "texture.h"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Scene description, intersection, shading and the tiled multithreaded render loop,
+// shared by the program and the regression tests.
+
+
+typedef struct {
+    Eigen::MatrixXd R;
+    Eigen::MatrixXd B;
+    Eigen::MatrixXd G;
+    Eigen::MatrixXd A;
+} scene_output;
+
+typedef struct {
+    Eigen::Vector3d origin;
+    Eigen::Vector3d u;
+    Eigen::Vector3d v;
+} pgram_parameters;
+
+typedef struct {
+    pgram_parameters pgram;  //emitting parallelogram, sampled over origin + a*u + b*v
+    Eigen::Vector3d color;
+    int samples;             //shadow rays per shading point, stratified over the parallelogram and rounded up to a full grid
+} area_light;
+
+typedef struct {
+    int width;
+    int height;
+    enum {ORTHO, PERSP} perspective;
+    Eigen::Vector3d image_origin;
+    Eigen::Vector3d light_position;
+    Eigen::Vector3d camera_origin;
+    int samples;  //rays per pixel, jittered when > 1 (0 is treated as 1)
+    int threads;  //render threads, 0 uses every hardware thread
+    std::vector<area_light> area_lights;  //soft shadowed emitters, added on top of the point light
+} scene_parameters;
+
+typedef struct {
+    Eigen::Vector3d diffuse_color;
+    double specular_exponent;
+    Eigen::Vector3d specular_color;    
+    Eigen::Vector3d ambient_color;
+    double ambient;
+    const texture *diffuse_texture;  //multiplies diffuse_color when set
+    double texture_scale;            //texture repeats across the surface, 0 is treated as 1
+    enum {TRILINEAR, BILINEAR} texture_filter;
+} shading_parameters;
+
+typedef struct {
+    Eigen::Vector3d center;
+    double radius;    	
+} sphere_parameters;
+
+typedef struct {
+    enum{SPHERE, PGRAM} type;
+    sphere_parameters sphere;
+    pgram_parameters pgram;
+    shading_parameters shading;
+} shape;
+
+
+void generate_ray(const scene_parameters &scene, const double x, const double y,
+		  Eigen::Vector3d &ray_origin, Eigen::Vector3d &ray_direction) {
+
+    const Eigen::Vector3d x_displacement(2.0 / scene.width, 0, 0);
+    const Eigen::Vector3d y_displacement(0, -2.0 / scene.height, 0);
+
+    const Eigen::Vector3d pixel_center = scene.image_origin + x * x_displacement + y * y_displacement;
+
+    if (scene.perspective == scene_parameters::ORTHO) {
+	ray_origin = pixel_center;
+	ray_direction = Eigen::Vector3d(0, 0, -1);
+    }
+
+    else {
+	ray_origin = scene.camera_origin;
+	ray_direction = pixel_center - ray_origin;
+    }
+}
+
+bool intersect_sphere(const Eigen::Vector3d &ray_origin, const Eigen::Vector3d &ray_direction, const sphere_parameters &sphere,
+		      double &depth, Eigen::Vector3d &ray_intersection, Eigen::Vector3d &ray_normal) {
+
+    const Eigen::Vector3d c = (ray_origin - sphere.center);
+    const double disc = std::pow(ray_direction.dot(c), 2.0) - (ray_direction.dot(ray_direction))*(c.dot(c) - std::pow(sphere.radius, 2.0));
+
+    if (disc < 0) return false;
+
+    double t = ((-1 * ray_direction).dot(c) - sqrt(disc))/(ray_direction.dot(ray_direction));
+    if (t < 0) t = ((-1 * ray_direction).dot(c) + sqrt(disc))/(ray_direction.dot(ray_direction));
+
+    depth = std::abs((t*ray_direction)(2));
+    ray_intersection = ray_origin + t*ray_direction;
+    ray_normal = (ray_intersection - sphere.center).normalized();
+    return true;
+}
+
+bool intersect_parallelogram(const Eigen::Vector3d &ray_origin, const Eigen::Vector3d &ray_direction, const pgram_parameters &pgram,
+			     double &depth, Eigen::Vector3d &ray_intersection, Eigen::Vector3d &ray_normal) {
+
+    Eigen::Matrix3d Y;
+    Y << -pgram.u, -pgram.v, ray_direction.normalized();
+    Eigen::Vector3d b = pgram.origin - ray_origin;
+    Eigen::Vector3d x = Y.inverse()*b;
+
+    //written as a positive test so a degenerate (NaN) solve counts as a miss
+    if (!((x(0) <= 1) && (x(0) >= 0) &&
+	  (x(1) <= 1) && (x(1) >= 0))) return false;
+
+    depth = x(2);
+    ray_intersection = pgram.origin + x(0) * pgram.u  + x(1) * pgram.v;
+    ray_normal = pgram.v.cross(pgram.u).normalized();
+    return true;
+}
+
+bool intersect_shape(const Eigen::Vector3d &ray_origin, const Eigen::Vector3d &ray_direction, const shape &obj,
+		     double &depth, Eigen::Vector3d &ray_intersection, Eigen::Vector3d &ray_normal) {
+
+    if (obj.type == shape::PGRAM) return intersect_parallelogram(ray_origin, ray_direction, obj.pgram, depth, ray_intersection, ray_normal);
+    else return intersect_sphere(ray_origin, ray_direction, obj.sphere, depth, ray_intersection, ray_normal);
+}
+
+/*
+ * Diffuse texture colour at a hit point.
+ * Spheres are mapped by the longitude and latitude of the normal, parallelograms by the (u, v)
+ * position of the hit along their two sides. The mip level is the width of one pixel projected
+ * onto the surface, measured in texels.
+ */
+Eigen::Vector3d texture_color(const scene_parameters &scene, const shape &obj, const Eigen::Vector3d &ray_origin,
+		       const Eigen::Vector3d &ray_direction, const Eigen::Vector3d &ray_intersection, const Eigen::Vector3d &ray_normal) {
+
+    const texture &tex = *obj.shading.diffuse_texture;
+    const double scale = (obj.shading.texture_scale > 0) ? obj.shading.texture_scale : 1;
+    double u, v, texels_per_unit;
+
+    if (obj.type == shape::PGRAM) {
+	const pgram_parameters &pgram = obj.pgram;
+	Eigen::Matrix<double, 3, 2> sides;
+	sides << pgram.u, pgram.v;
+	const Eigen::Vector2d uv = (sides.transpose() * sides).ldlt().solve(sides.transpose() * (ray_intersection - pgram.origin));
+	u = uv(0);
+	v = uv(1);
+	texels_per_unit = std::max(tex.levels[0].width / pgram.u.norm(), tex.levels[0].height / pgram.v.norm());
+    }
+    else {
+	const double r = obj.sphere.radius;
+	u = 0.5 + std::atan2(ray_normal(0), ray_normal(2)) / (2 * M_PI);
+	v = 0.5 - std::asin(std::max(-1., std::min(1., ray_normal(1)))) / M_PI;
+	texels_per_unit = std::max(tex.levels[0].width / (2 * M_PI * r), tex.levels[0].height / (M_PI * r));
+    }
+
+    if (obj.shading.texture_filter == shading_parameters::BILINEAR) return sample_bilinear(tex, 0, scale * u, scale * v);
+
+    //pixel width on the image plane, grown with distance under PERSP and with the grazing angle
+    double footprint = 2.0 / scene.width / std::sqrt(double(std::max(scene.samples, 1)));
+    if (scene.perspective == scene_parameters::PERSP) footprint *= (ray_intersection - ray_origin).norm() / ray_direction.norm();
+    footprint /= std::max(std::abs(ray_direction.normalized().dot(ray_normal)), 1e-3);
+
+    return sample_trilinear(tex, scale * u, scale * v, std::log2(footprint * scale * texels_per_unit));
+}
+
+/*
+ * Returns true if any object lies strictly between from and to.
+ * The intersection routines report the nearest point on the ray's line, so the hit is
+ * re-expressed as a parameter along the segment before it is accepted as a blocker.
+ */
+bool occluded(const std::vector<shape> &objects, const Eigen::Vector3d &from, const Eigen::Vector3d &to) {
+    const double epsilon = 1e-6;
+    const Eigen::Vector3d d = to - from;
+
+    for (auto & obj: objects) {
+	double depth;
+	Eigen::Vector3d p;
+	Eigen::Vector3d n;
+	if (!intersect_shape(from, d, obj, depth, p, n)) continue;
+
+	const double t = (p - from).dot(d) / d.dot(d);
+	if ((t > epsilon) && (t < 1 - epsilon)) return true;
+    }
+    return false;
+}
+
+/*
+ * Diffuse and specular light arriving from a single position on an area light, added to light.
+ * Returns false, adding nothing, when the position is behind the surface or the path to it is
+ * blocked; a visible position can still add nothing, e.g. on a black surface.
+ */
+bool light_sample(const std::vector<shape> &objects, const Eigen::Vector3d &v, const Eigen::Vector3d &ray_intersection,
+		  const Eigen::Vector3d &ray_normal, const shading_parameters &color, const Eigen::Vector3d &light_point,
+		  Eigen::Vector3d &light) {
+
+    const Eigen::Vector3d light_ray = (light_point - ray_intersection).normalized();
+    if (light_ray.dot(ray_normal) <= 0) return false;
+
+    //offset along the normal so the surface does not shadow itself
+    if (occluded(objects, ray_intersection + 1e-6 * ray_normal, light_point)) return false;
+
+    const Eigen::Vector3d phong = (v + light_ray).normalized();
+    const Eigen::Vector3d diffuse_v = light_ray.dot(ray_normal) * color.diffuse_color;
+    const Eigen::Vector3d specular_v = std::pow(std::max(phong.dot(ray_normal), 0.), color.specular_exponent) * color.specular_color;
+    light += diffuse_v + specular_v;
+    return true;
+}
+
+/*
+ * Stratified estimate of the light from one area light.
+ * The parallelogram is split into a cols x rows grid with one jittered sample per cell, the
+ * smallest grid with at least the requested number of samples, so every cell is sampled and
+ * the whole light is covered evenly.
+ * The corner cells are traced first; when they all agree on visibility the point is
+ * treated as fully lit or fully shadowed and the remaining cells are skipped, so the
+ * full sample count is only paid inside the penumbra.
+ */
+Eigen::Vector3d shade_area_light(const std::vector<shape> &objects, const area_light &light, const Eigen::Vector3d &v,
+			  const Eigen::Vector3d &ray_intersection, const Eigen::Vector3d &ray_normal,
+			  const shading_parameters &color, sample_stream &stream) {
+
+    const int cols = std::max(1, int(std::ceil(std::sqrt(double(light.samples)))));
+    const int rows = std::max(1, (light.samples + cols - 1) / cols);
+    const int samples = rows * cols;
+
+    auto cell_point = [&](int cell) {
+	const double a = ((cell % cols) + next_uniform(stream)) / cols;
+	const double b = ((cell / cols) + next_uniform(stream)) / rows;
+	return Eigen::Vector3d(light.pgram.origin + a * light.pgram.u + b * light.pgram.v);
+    };
+
+    std::vector<int> probes = {0, cols - 1, (rows - 1) * cols, samples - 1};
+    std::sort(probes.begin(), probes.end());
+    probes.erase(std::unique(probes.begin(), probes.end()), probes.end());
+
+    Eigen::Vector3d sum(0, 0, 0);
+    int visible = 0;
+    for (int cell: probes) {
+	if (light_sample(objects, v, ray_intersection, ray_normal, color, cell_point(cell), sum)) ++visible;
+    }
+
+    if ((visible == 0) || (visible == int(probes.size()))) return (sum / probes.size()).cwiseProduct(light.color);
+
+    for (int cell = 0; cell < samples; ++cell) {
+	if (std::binary_search(probes.begin(), probes.end(), cell)) continue;
+	light_sample(objects, v, ray_intersection, ray_normal, color, cell_point(cell), sum);
+    }
+    return (sum / samples).cwiseProduct(light.color);
+}
+
+Eigen::Vector3d shade(const scene_parameters &scene, const Eigen::Vector3d &ray_origin, const Eigen::Vector3d &ray_intersection,
+	       const Eigen::Vector3d &ray_normal, const shading_parameters &color,
+	       const std::vector<shape> &objects, const uint32_t pixel, const int sample) {
+
+    const Eigen::Vector3d ambient_v = color.ambient * color.ambient_color;
+
+    const Eigen::Vector3d v = (ray_origin - ray_intersection).normalized();
+    const Eigen::Vector3d light_ray = (scene.light_position - ray_intersection).normalized();
+    const Eigen::Vector3d phong = (v + light_ray).normalized();
+
+    const Eigen::Vector3d diffuse_v = std::max(light_ray.dot(ray_normal), 0.) * color.diffuse_color;
+    const Eigen::Vector3d specular_v = std::pow(std::max(phong.dot(ray_normal), 0.), color.specular_exponent) * color.specular_color;
+
+    Eigen::Vector3d result = ambient_v + diffuse_v + specular_v;
+
+    //shadow rays are the first bounce; each light draws from its own stream
+    for (unsigned l = 0; l < scene.area_lights.size(); ++l) {
+	sample_stream stream = make_sample_stream(pixel, sample, 1, l);
+	result += shade_area_light(objects, scene.area_lights[l], v, ray_intersection, ray_normal, color, stream);
+    }
+
+    return result;
+}
+
+typedef struct {
+    int x0, y0, x1, y1;  //inclusive pixel range, empty when x0 > x1
+} screen_bounds;
+
+const int tile_size = 32;
+
+/*
+ * Conservative pixel range covered by the convex hull of points.
+ * Under ORTHO the rays run along -z so the points are simply dropped onto the image plane.
+ * Under PERSP they are projected through the camera onto the image plane; the intersection
+ * routines accept hits on either side of the camera, so this is a projection of lines rather
+ * than rays and stays valid as long as the hull does not cross the plane through the camera
+ * parallel to the image. If it does the primitive may cover any pixel.
+ */
+screen_bounds project_bounds(const scene_parameters &scene, const std::vector<Eigen::Vector3d> &points) {
+    const screen_bounds full = {0, 0, scene.width - 1, scene.height - 1};
+
+    double x_min = INFINITY, x_max = -INFINITY, y_min = INFINITY, y_max = -INFINITY;
+    int in_front = 0;
+
+    for (auto & p: points) {
+	Eigen::Vector3d q = p;
+
+	if (scene.perspective == scene_parameters::PERSP) {
+	    const double dz = p(2) - scene.camera_origin(2);
+	    if (std::abs(dz) < 1e-9) return full;
+	    if (dz < 0) ++in_front;
+
+	    const double s = (scene.image_origin(2) - scene.camera_origin(2)) / dz;
+	    q = scene.camera_origin + s * (p - scene.camera_origin);
+	}
+
+	//continuous pixel coordinates, the inverse of generate_ray
+	const double x = (q(0) - scene.image_origin(0)) * scene.width / 2.0;
+	const double y = (scene.image_origin(1) - q(1)) * scene.height / 2.0;
+	x_min = std::min(x_min, x); x_max = std::max(x_max, x);
+	y_min = std::min(y_min, y); y_max = std::max(y_max, y);
+    }
+
+    if ((in_front != 0) && (in_front != int(points.size()))) return full;
+
+    //samples are taken on [i, i + 1) so pad by a pixel on each side for jitter and rounding
+    screen_bounds b = {
+	std::max(0, int(std::floor(std::max(x_min, -1.0))) - 1),
+	std::max(0, int(std::floor(std::max(y_min, -1.0))) - 1),
+	std::min(scene.width - 1, int(std::ceil(std::min(x_max, double(scene.width)))) + 1),
+	std::min(scene.height - 1, int(std::ceil(std::min(y_max, double(scene.height)))) + 1)
+    };
+    return b;
+}
+
+screen_bounds shape_bounds(const scene_parameters &scene, const shape &obj) {
+    std::vector<Eigen::Vector3d> points;
+
+    if (obj.type == shape::PGRAM) {
+	const pgram_parameters &pgram = obj.pgram;
+	points = {pgram.origin, pgram.origin + pgram.u, pgram.origin + pgram.v, pgram.origin + pgram.u + pgram.v};
+    }
+    else {
+	//corners of the bounding box, whose hull contains the sphere
+	const sphere_parameters &sphere = obj.sphere;
+	for (int c = 0; c < 8; ++c) {
+	    points.push_back(sphere.center + sphere.radius * Eigen::Vector3d((c & 1) ? 1 : -1, (c & 2) ? 1 : -1, (c & 4) ? 1 : -1));
+	}
+    }
+
+    return project_bounds(scene, points);
+}
+
+/*
+ * Runs task(0) .. task(count - 1) on the given number of threads.
+ * Indices are handed out dynamically; callers only write to disjoint data per index.
+ */
+void parallel_for(const int count, const int threads, const std::function<void(int)> &task) {
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+	for (int k = next++; k < count; k = next++) task(k);
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < std::min(threads, count); ++t) pool.emplace_back(worker);
+    worker();
+    for (auto & th: pool) th.join();
+}
+
+/*
+ * Traces every sample of pixel (i, j) against the candidate objects of its tile and writes the averaged colour.
+ * Objects are visited in list order and a later object only wins when it is strictly
+ * closer, so the result is independent of how pixels are split between threads.
+ */
+void trace_pixel(scene_output &image, const scene_parameters &scene, const std::vector<shape> &objects,
+		 const std::vector<int> &candidates, const unsigned i, const unsigned j) {
+
+    const int samples = std::max(scene.samples, 1);
+    const uint32_t pixel = j * scene.width + i;
+
+    Eigen::Vector3d sum(0, 0, 0);
+    double coverage = 0;
+
+    for (int s = 0; s < samples; ++s) {
+	sample_stream stream = make_sample_stream(pixel, s, 0);
+
+	//a single sample stays on the pixel corner so un-jittered renders match the reference images
+	double dx = 0, dy = 0;
+	if (samples > 1) {
+	    dx = next_uniform(stream);
+	    dy = next_uniform(stream);
+	}
+
+	Eigen::Vector3d ray_origin;
+	Eigen::Vector3d ray_direction;
+	generate_ray(scene, double(i) + dx, double(j) + dy, ray_origin, ray_direction);
+
+	double closest = 0;  //used to check if objects hit by a ray are covered by a closer object
+	const shape *nearest = NULL;
+	Eigen::Vector3d nearest_intersection;
+	Eigen::Vector3d nearest_normal;
+
+	for (int k: candidates) {
+	    const shape &obj = objects[k];
+	    double depth;
+	    Eigen::Vector3d ray_intersection;
+	    Eigen::Vector3d ray_normal;
+
+	    if (intersect_shape(ray_origin, ray_direction, obj, depth, ray_intersection, ray_normal) &&
+		((closest == 0) || (depth < closest))) {
+		closest = depth;
+		nearest = &obj;
+		nearest_intersection = ray_intersection;
+		nearest_normal = ray_normal;
+	    }
+	}
+
+	//only the visible surface is shaded, so shadow rays are not spent on covered objects
+	const bool hit = (nearest != NULL);
+	Eigen::Vector3d sample_color(0, 0, 0);
+	if (hit) {
+	    shading_parameters surface = nearest -> shading;
+	    if (surface.diffuse_texture != NULL) {
+		surface.diffuse_color = surface.diffuse_color.cwiseProduct(
+		    texture_color(scene, *nearest, ray_origin, ray_direction, nearest_intersection, nearest_normal));
+	    }
+	    sample_color = shade(scene, ray_origin, nearest_intersection, nearest_normal, surface, objects, pixel, s);
+	}
+
+	if (hit) {
+	    sum += sample_color;
+	    coverage += 1;
+	}
+    }
+
+    image.R(i, j) = sum(0) / samples;
+    image.B(i, j) = sum(1) / samples;
+    image.G(i, j) = sum(2) / samples;
+    image.A(i, j) = coverage / samples;
+}
+
+
+/*
+ * Traces every pixel of the scene into a new image.
+ * The image is the same for any number of threads.
+ */
+scene_output render_image(const scene_parameters &scene, const std::vector<shape> &objects) {
+
+    scene_output image = {
+	.R = Eigen::MatrixXd::Zero(scene.width, scene.height),
+	.B = Eigen::MatrixXd::Zero(scene.width, scene.height),
+	.G = Eigen::MatrixXd::Zero(scene.width, scene.height),
+	.A = Eigen::MatrixXd::Zero(scene.width, scene.height)
+    };
+
+    const int threads = (scene.threads > 0) ? scene.threads : std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<screen_bounds> bounds;
+    for (auto & obj: objects) bounds.push_back(shape_bounds(scene, obj));
+
+    //each tile only intersects the objects whose projected bounds overlap it, kept in scene order
+    const int tiles_x = (scene.width + tile_size - 1) / tile_size;
+    const int tiles_y = (scene.height + tile_size - 1) / tile_size;
+    std::vector<std::vector<int> > tile_objects(tiles_x * tiles_y);
+
+    parallel_for(tiles_x * tiles_y, threads, [&](int tile) {
+	const int x0 = (tile % tiles_x) * tile_size, y0 = (tile / tiles_x) * tile_size;
+	const int x1 = x0 + tile_size - 1, y1 = y0 + tile_size - 1;
+
+	for (unsigned k = 0; k < objects.size(); ++k) {
+	    const screen_bounds &b = bounds[k];
+	    if ((b.x0 <= x1) && (b.x1 >= x0) && (b.y0 <= y1) && (b.y1 >= y0)) tile_objects[tile].push_back(k);
+	}
+    });
+
+    //every pixel is independent so the image does not depend on how tiles are split between threads
+    parallel_for(tiles_x * tiles_y, threads, [&](int tile) {
+	if (tile_objects[tile].empty()) return;  //empty sky, the image is already cleared
+
+	const int x0 = (tile % tiles_x) * tile_size, y0 = (tile / tiles_x) * tile_size;
+	for (int j = y0; j < std::min(y0 + tile_size, scene.height); ++j) {
+	    for (int i = x0; i < std::min(x0 + tile_size, scene.width); ++i) trace_pixel(image, scene, objects, tile_objects[tile], i, j);
+	}
+    });
+
+    return image;
+}
+
+double raytrace(std::string filename, scene_parameters scene, std::vector<shape> objects) {
+
+    std::cout << "Ray tracing to " << filename << std::endl; 
+
+    const auto start = std::chrono::steady_clock::now();
+
+    const scene_output image = render_image(scene, objects);
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "  " << seconds << " s" << std::endl;
+
+    write_matrix_to_png(image.R, image.B, image.G, image.A, filename);
+
+    return seconds;
+ }
+
+#endif
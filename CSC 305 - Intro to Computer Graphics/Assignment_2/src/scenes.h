@@ -0,0 +1,300 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "raytracer.h"
+#include <string>
+#include <vector>
+
+// The scenes rendered by the program, also traced by the regression tests.
+
+typedef struct {
+    std::string filename;
+    scene_parameters scene;
+    std::vector<shape> objects;
+} scene_render;
+
+/*
+ * 256x256 checkerboard used by the textured scene when no texture file is given.
+ */
+texture checkerboard_texture() {
+    std::vector<unsigned char> checker(256 * 256 * 4);
+    for (int y = 0; y < 256; ++y) {
+	for (int x = 0; x < 256; ++x) {
+	    const unsigned char c = (((x / 32) + (y / 32)) % 2) ? 230 : 40;
+	    for (int k = 0; k < 3; ++k) checker[(y * 256 + x) * 4 + k] = c;
+	    checker[(y * 256 + x) * 4 + 3] = 255;
+	}
+    }
+    return make_texture(checker.data(), 256, 256);
+}
+
+/*
+ * Builds the scenes in render order, each with the file its image is written to.
+ * The textured scene points into tex, which must outlive the scenes. With stress set two
+ * heavier scenes are added at the end.
+ */
+std::vector<scene_render> make_scenes(const int width, const int height, const int threads, const texture &tex,
+				      const bool stress) {
+    std::vector<shape> objects;
+    
+    scene_parameters scene = {
+	.width = width,
+	.height = height,
+	.perspective = scene_parameters::ORTHO,
+	.image_origin = Eigen::Vector3d(-1,1,1),
+	.light_position = Eigen::Vector3d(-1,1,1),
+	.camera_origin = Eigen::Vector3d(0,0,3),
+	.samples = 1,
+	.threads = threads
+    };    
+       
+    std::vector<scene_render> scenes;
+    auto add_scene = [&](std::string filename) {
+	scenes.push_back({filename, scene, objects});
+    };
+
+    shading_parameters color = {
+	.diffuse_color = Eigen::Vector3d(1, 1, 1),
+	.specular_exponent = 100,
+	.specular_color = Eigen::Vector3d(0,0,0),
+	.ambient_color = Eigen::Vector3d(1,1,1),
+	.ambient = 0.1
+    };
+
+    shading_parameters pink = color;
+    pink.diffuse_color = Eigen::Vector3d(1,0,1);
+    pink.specular_color = Eigen::Vector3d(0,0,1);
+
+    shading_parameters green = color;
+    green.diffuse_color = Eigen::Vector3d(0, 0.6, 0);
+    green.specular_color = Eigen::Vector3d(1, 0, 1);    
+
+    shading_parameters yellow = color;
+    yellow.diffuse_color = Eigen::Vector3d(0.8, 0.8, 0);
+    yellow.specular_color = Eigen::Vector3d(0, 0, 1);
+
+    shading_parameters blue = color;
+    blue.diffuse_color = Eigen::Vector3d(0, 0, 0.4);
+    blue.specular_color = Eigen::Vector3d(1, 1, 0);
+
+        
+    // orthographic parallelogram
+        
+    pgram_parameters pgram = {
+	.origin = Eigen::Vector3d(-0.5, -0.5, 0),
+	.u = Eigen::Vector3d(0, 0.7, -10),
+	.v = Eigen::Vector3d(1, 0.4, 0)
+    };
+
+    shape s2 = {
+	.type = shape::PGRAM,
+	.pgram = pgram,
+	.shading = green,
+    };
+
+    objects.push_back(s2);
+    add_scene("plane_orthographic.png");
+    objects.clear();
+    
+    
+    // perpective parallelogram
+    
+    scene.perspective = scene_parameters::PERSP;
+    s2.shading = yellow;
+    objects.push_back(s2);
+    add_scene("plane_perspective.png");
+    objects.clear();
+
+
+
+    
+    // perpective sphere with pink shading
+
+    sphere_parameters sphere = {
+	.center = Eigen::Vector3d(0,0,0),
+	.radius = 0.9,
+    };
+    
+    shape s3 = {
+	.type = shape::SPHERE,
+	.sphere = sphere,
+	.shading = blue
+    };
+
+    objects.push_back(s3);
+    add_scene("shading.png");
+    objects.clear();
+
+
+
+    // multiobject scene    
+
+    sphere_parameters sphere_small = {
+	.center = Eigen::Vector3d(0.4, 0, 0),
+	.radius = 0.3
+    };
+
+         
+    shape s4 = {
+	.type = shape::SPHERE,
+	.sphere = sphere_small,
+	.shading = green
+    };
+    
+    objects.push_back(s4);
+    
+    sphere_small.center = Eigen::Vector3d(0, 0.2, -1);
+
+    shape s5 = {
+	.type = shape::SPHERE,
+	.sphere = sphere_small,
+	.shading = yellow,
+    };
+
+    objects.push_back(s5);
+
+    sphere_parameters sphere_big = {
+	.center = Eigen::Vector3d(2, 0, -4),
+	.radius = 2,
+    };
+
+    shape s6 = {
+	.type = shape::SPHERE,
+	.sphere = sphere_big,
+	.shading = pink,
+    };
+
+    objects.push_back(s6);
+
+    sphere_small.center = Eigen::Vector3d(-0.4, 0.5, -2);
+
+    shape s7 = {
+	.type = shape::SPHERE,
+	.sphere = sphere_small,
+	.shading = blue,
+    };
+
+    objects.push_back(s7);
+
+    sphere_small.center = Eigen::Vector3d(-0.25, 0.85, -3);
+
+    shape s8 = {
+	.type = shape::SPHERE,
+	.sphere = sphere_small,
+	.shading = yellow,
+    };
+
+    objects.push_back(s8);
+    
+    pgram_parameters floor = {
+	.origin = Eigen::Vector3d(-4, -4, 0),
+	.u = Eigen::Vector3d(0, 4, -10),
+	.v = Eigen::Vector3d(8, 0, 0)
+    };
+
+    shape s9 = {
+	.type = shape::PGRAM,
+	.pgram = floor,
+	.shading = color,
+    };
+    
+    objects.push_back(s9);
+
+    pgram_parameters wall = {
+	.origin = Eigen::Vector3d(4, -4, 0),
+	.u = Eigen::Vector3d(-2, 4, -10),
+	.v = Eigen::Vector3d(0, 6, 0),
+    };
+
+    shape s10 = {
+	.type = shape::PGRAM,
+	.pgram = wall,
+	.shading = color,
+    };
+    
+    objects.push_back(s10);
+
+    sphere_small.center = Eigen::Vector3d(0.2, 1.2, -4);
+
+    shape s11 = {
+	.type = shape::SPHERE,
+	.sphere = sphere_small,
+	.shading = green,
+    };
+
+    objects.push_back(s11);
+    
+    add_scene("multiobject.png");            	   
+
+
+    // multiobject scene lit by an overhead area light with soft shadows
+
+    area_light panel = {
+	.pgram = {
+	    .origin = Eigen::Vector3d(-1, 3, 0),
+	    .u = Eigen::Vector3d(1, 0, 0),
+	    .v = Eigen::Vector3d(0, 0, -1)
+	},
+	.color = Eigen::Vector3d(0.4, 0.4, 0.4),
+	.samples = 16
+    };
+
+    scene.area_lights.push_back(panel);
+    add_scene("soft_shadows.png");
+
+
+    // textured floor and sphere, trilinear filtering keeps the receding floor from aliasing
+
+    shading_parameters textured = color;
+    textured.diffuse_texture = &tex;
+    textured.texture_scale = 4;
+
+    shape textured_floor = s9;
+    textured_floor.shading = textured;
+
+    shape textured_sphere = s3;
+    textured_sphere.sphere.center = Eigen::Vector3d(0, 0, -1);
+    textured_sphere.sphere.radius = 0.5;
+    textured_sphere.shading = textured;
+    textured_sphere.shading.texture_scale = 1;
+
+    objects = {textured_floor, textured_sphere};
+    scene.area_lights.clear();
+    add_scene("textured.png");
+         	 
+
+    if (stress) {
+	// many small spheres above the floor, mostly separated by empty space
+
+	scene.area_lights.clear();
+	objects.clear();
+	objects.push_back(s9);
+
+	shading_parameters palette[] = {pink, green, yellow, blue};
+	for (int a = 0; a < 20; ++a) {
+	    for (int b = 0; b < 20; ++b) {
+		shape s = {
+		    .type = shape::SPHERE,
+		    .sphere = {
+			.center = Eigen::Vector3d(-1.9 + 0.2 * a, -0.5 + 0.05 * b, -0.5 * b),
+			.radius = 0.06
+		    },
+		    .shading = palette[(a + b) % 4]
+		};
+		objects.push_back(s);
+	    }
+	}
+	add_scene("stress_spheres.png");
+
+	// soft shadowed multiobject scene with jittered antialiasing
+
+	objects = {s4, s5, s6, s7, s8, s9, s10, s11};
+	scene.area_lights.push_back(panel);
+	scene.samples = 4;
+	add_scene("stress_soft_shadows_aa.png");
+    }
+
+    return scenes;
+}
+
+#endif
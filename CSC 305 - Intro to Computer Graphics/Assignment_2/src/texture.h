@@ -0,0 +1,130 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include "stb_image.h"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Mip-mapped image textures.
+// Each level is stored in 8x8 texel tiles (256 bytes of RGBA8), so the four texels of a
+// bilinear lookup and the neighbouring lookups of nearby pixels share a few cache lines
+// instead of striding across whole rows of a large image.
+
+const int texture_tile = 8;
+
+typedef struct {
+	int width;
+	int height;
+	int tiles_x;                 // tiles per row of tiles
+	std::vector<uint32_t> texels;   // RGBA8, tile by tile, row-major inside a tile
+} texture_level;
+
+typedef struct {
+	std::vector<texture_level> levels;  // levels[0] is full resolution, each next level half the size
+} texture;
+
+size_t texel_index(const texture_level& level, const int x, const int y) {
+	const int tile = (y / texture_tile) * level.tiles_x + (x / texture_tile);
+	return size_t(tile) * texture_tile * texture_tile + (y % texture_tile) * texture_tile + (x % texture_tile);
+}
+
+texture_level make_texture_level(const int w, const int h) {
+	texture_level level;
+	level.width = w;
+	level.height = h;
+	level.tiles_x = (w + texture_tile - 1) / texture_tile;
+	const int tiles_y = (h + texture_tile - 1) / texture_tile;
+	level.texels.assign(size_t(level.tiles_x) * tiles_y * texture_tile * texture_tile, 0);
+	return level;
+}
+
+// Builds the pyramid from a row-major RGBA8 image; smaller levels use a 2x2 box filter
+texture make_texture(const unsigned char* rgba, const int w, const int h) {
+	texture tex;
+
+	texture_level base = make_texture_level(w, h);
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			const unsigned char* p = rgba + (size_t(y) * w + x) * 4;
+			base.texels[texel_index(base, x, y)] = p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+		}
+	}
+	tex.levels.push_back(base);
+
+	while ((tex.levels.back().width > 1) || (tex.levels.back().height > 1)) {
+		const texture_level& prev = tex.levels.back();
+		texture_level next = make_texture_level(std::max(1, prev.width / 2), std::max(1, prev.height / 2));
+
+		for (int y = 0; y < next.height; ++y) {
+			for (int x = 0; x < next.width; ++x) {
+				// odd sizes clamp the second texel onto the first
+				const int x0 = std::min(2 * x, prev.width - 1), x1 = std::min(2 * x + 1, prev.width - 1);
+				const int y0 = std::min(2 * y, prev.height - 1), y1 = std::min(2 * y + 1, prev.height - 1);
+				const uint32_t t[4] = {
+					prev.texels[texel_index(prev, x0, y0)], prev.texels[texel_index(prev, x1, y0)],
+					prev.texels[texel_index(prev, x0, y1)], prev.texels[texel_index(prev, x1, y1)]
+				};
+
+				uint32_t packed = 0;
+				for (int c = 0; c < 4; ++c) {
+					const uint32_t sum = ((t[0] >> (8 * c)) & 0xFF) + ((t[1] >> (8 * c)) & 0xFF) +
+						((t[2] >> (8 * c)) & 0xFF) + ((t[3] >> (8 * c)) & 0xFF);
+					packed |= ((sum + 2) / 4) << (8 * c);
+				}
+				next.texels[texel_index(next, x, y)] = packed;
+			}
+		}
+		tex.levels.push_back(next);
+	}
+
+	return tex;
+}
+
+bool load_texture(const std::string& filename, texture& tex) {
+	int w, h, comp;
+	unsigned char* data = stbi_load(filename.c_str(), &w, &h, &comp, 4);
+	if (data == NULL) return false;
+
+	tex = make_texture(data, w, h);
+	stbi_image_free(data);
+	return true;
+}
+
+// Texel colour with repeat addressing
+Eigen::Vector3d texel(const texture_level& level, int x, int y) {
+	x %= level.width;  if (x < 0) x += level.width;
+	y %= level.height; if (y < 0) y += level.height;
+
+	const uint32_t t = level.texels[texel_index(level, x, y)];
+	return Eigen::Vector3d(t & 0xFF, (t >> 8) & 0xFF, (t >> 16) & 0xFF) / 255.0;
+}
+
+// (u, v) in [0, 1) covers the texture once, v = 0 is the top row
+Eigen::Vector3d sample_bilinear(const texture& tex, const int level_index, const double u, const double v) {
+	const texture_level& level = tex.levels[level_index];
+	const double x = u * level.width - 0.5;
+	const double y = v * level.height - 0.5;
+	const int x0 = int(std::floor(x)), y0 = int(std::floor(y));
+	const double fx = x - x0, fy = y - y0;
+
+	return (1 - fy) * ((1 - fx) * texel(level, x0, y0) + fx * texel(level, x0 + 1, y0)) +
+		fy * ((1 - fx) * texel(level, x0, y0 + 1) + fx * texel(level, x0 + 1, y0 + 1));
+}
+
+// lod is log2 of the pixel footprint in level 0 texels; blends the two nearest levels
+Eigen::Vector3d sample_trilinear(const texture& tex, const double u, const double v, const double lod) {
+	const int last = int(tex.levels.size()) - 1;
+	const double l = std::min(std::max(lod, 0.), double(last));
+	const int l0 = int(std::floor(l));
+	const int l1 = std::min(l0 + 1, last);
+	const double f = l - l0;
+
+	if (f == 0) return sample_bilinear(tex, l0, u, v);
+	return (1 - f) * sample_bilinear(tex, l0, u, v) + f * sample_bilinear(tex, l1, u, v);
+}
+
+#endif
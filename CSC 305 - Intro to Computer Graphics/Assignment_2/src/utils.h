@@ -2,8 +2,11 @@
 #define UTILS_H
 
 #include "stb_image_write.h"
+#include "stb_image.h"
 #include <Eigen/Dense>
 #include <algorithm>
+#include <cstdlib>
+#include <string>
 #include <vector>
 
 unsigned char double_to_unsignedchar(const double d) {
@@ -50,4 +53,32 @@ void write_matrix_to_png(
 
 }
 
+bool read_png_to_uint8(const std::string& filename, std::vector<uint8_t>& image, int& w, int& h)
+{
+	const int comp = 4;                                  // Always expand to Red, Green, Blue, Alpha
+	int file_comp;
+	unsigned char *data = stbi_load(filename.c_str(), &w, &h, &file_comp, comp);
+	if (data == NULL) return false;
+
+	image.assign(data, data + w*h*comp);
+	stbi_image_free(data);
+	return true;
+}
+
+// Number of pixels whose largest channel difference exceeds tolerance; max_diff receives the largest difference seen
+int compare_uint8(const std::vector<uint8_t>& a, const std::vector<uint8_t>& b, const int tolerance, int& max_diff)
+{
+	assert(a.size() == b.size());
+
+	int mismatched = 0;
+	max_diff = 0;
+	for (size_t p = 0; p < a.size(); p += 4) {
+		int pixel_diff = 0;
+		for (int c = 0; c < 4; ++c) pixel_diff = std::max(pixel_diff, std::abs(int(a[p + c]) - int(b[p + c])));
+		max_diff = std::max(max_diff, pixel_diff);
+		if (pixel_diff > tolerance) ++mismatched;
+	}
+	return mismatched;
+}
+
 #endif
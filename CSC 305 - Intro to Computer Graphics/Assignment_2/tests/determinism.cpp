@@ -0,0 +1,57 @@
+// CSC305 Assignment 2
+// Regression test: every scene renders to the same image, bit for bit, on 1, 2 and many threads.
+
+// C++ include
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+// Image libraries, needed by the helpers in utils.h and texture.h
+#define STB_IMAGE_WRITE_IMPLEMENTATION // Do not include this line twice in your project!
+#include "stb_image_write.h"
+#define STB_IMAGE_IMPLEMENTATION // Do not include this line twice in your project!
+#include "stb_image.h"
+
+#include "raytracer.h"
+#include "scenes.h"
+
+/*
+ * 64-bit FNV-1a hash of the bytes of the four channels of image.
+ */
+uint64_t hash_image(const scene_output &image) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const Eigen::MatrixXd *channel: {&image.R, &image.G, &image.B, &image.A}) {
+	const unsigned char *bytes = reinterpret_cast<const unsigned char*>(channel -> data());
+	for (size_t k = 0; k < channel -> size() * sizeof(double); ++k) hash = (hash ^ bytes[k]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+int main()
+{
+    //smaller than the program's images to keep the test quick, still split over many tiles
+    const int size = 256;
+    const int threads[3] = {1, 2, int(std::max(4u, std::thread::hardware_concurrency()))};
+
+    const texture tex = checkerboard_texture();
+    bool passed = true;
+
+    for (auto & s: make_scenes(size, size, 0, tex, true)) {
+	uint64_t hashes[3];
+	for (int k = 0; k < 3; ++k) {
+	    s.scene.threads = threads[k];
+	    hashes[k] = hash_image(render_image(s.scene, s.objects));
+	}
+
+	const bool same = (hashes[0] == hashes[1]) && (hashes[0] == hashes[2]);
+	std::cout << (same ? "ok   " : "FAIL ") << s.filename << ":";
+	for (int k = 0; k < 3; ++k) std::cout << " " << threads[k] << " threads " << std::hex << std::setw(16) << std::setfill('0') << hashes[k] << std::dec;
+	std::cout << std::endl;
+	if (!same) passed = false;
+    }
+
+    return passed ? 0 : 1;
+}
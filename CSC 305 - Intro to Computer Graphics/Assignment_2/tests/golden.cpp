@@ -0,0 +1,239 @@
+// CSC305 Assignment 2
+// Regression test: every scene, the stress scenes included, is rendered at the program's size
+// and compared against the golden images in tests/golden, and optionally its render time
+// against the baseline in tests/golden/times.txt. Times are measured in units of a fixed
+// calibration workload timed in the same run, so the baseline carries over between machines.
+
+// C++ include
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// Image libraries, to write and read the golden images
+#define STB_IMAGE_WRITE_IMPLEMENTATION // Do not include this line twice in your project!
+#include "stb_image_write.h"
+#define STB_IMAGE_IMPLEMENTATION // Do not include this line twice in your project!
+#include "stb_image.h"
+
+#include "raytracer.h"
+#include "scenes.h"
+
+const int image_size = 800;  //the size the program renders at
+
+typedef struct {
+    std::string filename;
+    std::vector<uint8_t> image;  //RGBA8, as written to the png
+    double time;                 //fastest time spent tracing, in calibration units, excluding the conversion to 8 bits
+} render_record;
+
+typedef struct {
+    std::string golden_dir;    //compare each render against golden_dir/<filename>
+    int tolerance;             //largest per-channel difference accepted, in 8-bit steps
+    std::string baseline;      //file of "<filename> <time>" lines, times are checked when set
+    double max_slowdown;       //percent over the baseline that counts as a regression, for the mean of all scenes
+    double max_scene_slowdown; //the same for a single scene, which is noisier
+    int runs;                  //timed runs per scene, on one thread, the fastest is kept
+    double min_seconds;        //shortest run: a quicker render is repeated and its mean time taken
+    bool record;               //store this run as the new golden images and baseline instead of checking
+} check_parameters;
+
+volatile double calibration_sink;  //keeps the calibration work from being optimised away
+
+/*
+ * A fixed amount of floating point and vector work that does not depend on the ray tracer, so
+ * it runs equally fast before and after a change to it. Like a render it writes four channels of
+ * an image, so it is slowed down as much by a busy memory bus. The render times are divided by its time.
+ */
+void calibration_work() {
+    static Eigen::MatrixXd channels[4] = {
+	Eigen::MatrixXd(image_size, image_size), Eigen::MatrixXd(image_size, image_size),
+	Eigen::MatrixXd(image_size, image_size), Eigen::MatrixXd(image_size, image_size)
+    };
+    Eigen::Vector3d d(0.3, 0.5, 0.8);
+    for (int j = 0; j < image_size; ++j) {
+	for (int i = 0; i < image_size; ++i) {
+	    d = (d + Eigen::Vector3d(1e-3, -2e-3, 1.5e-3)).normalized();
+	    const double shade = std::sqrt(std::abs(d.dot(Eigen::Vector3d(0.2, 0.9, -0.4))));
+	    for (int c = 0; c < 4; ++c) channels[c](i, j) = shade * d[c % 3];
+	}
+    }
+    calibration_sink = channels[0](image_size / 2, image_size / 2);
+}
+
+/*
+ * Returns the mean time in seconds of one call to work, called until at least min_seconds have
+ * passed, so a render of a few milliseconds is not lost in timer and scheduling noise.
+ */
+double time_work(const std::function<void()> &work, const double min_seconds) {
+    const auto start = std::chrono::steady_clock::now();
+    int calls = 0;
+    double seconds;
+    do {
+	work();
+	++calls;
+	seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (seconds < min_seconds);
+    return seconds / calls;
+}
+
+/*
+ * Returns the time of work in calibration units: the fastest of the given number of runs divided
+ * by the fastest calibration run. The calibration is run right before each run of work, so both
+ * see the same clock speed and load even when they drift during the test.
+ */
+double relative_time(const std::function<void()> &work, const int runs, const double min_seconds) {
+    double best = 0, unit = 0;
+    for (int run = 0; run < runs; ++run) {
+	const double u = time_work(calibration_work, min_seconds);
+	const double t = time_work(work, min_seconds);
+	if ((run == 0) || (u < unit)) unit = u;
+	if ((run == 0) || (t < best)) best = t;
+    }
+    return best / unit;
+}
+
+
+/*
+ * Compares the renders of this run against stored golden images and a timing baseline.
+ * A render fails if any pixel differs from its golden image by more than the tolerance, or if
+ * it took more than max_scene_slowdown percent longer than its baseline time. The times also
+ * fail together if their geometric mean is more than max_slowdown percent over the baseline:
+ * a single scene can be thrown off by a burst of load on the machine, the mean of all much less.
+ * With record set the renders are written to the golden directory and the baseline is rewritten instead.
+ * Returns false if any render failed.
+ */
+bool check_renders(const std::vector<render_record> &renders, const check_parameters &check) {
+    bool passed = true;
+
+    if (check.record) {
+	for (auto & r: renders) {
+	    const std::string golden = check.golden_dir + "/" + r.filename;
+	    if (!stbi_write_png(golden.c_str(), image_size, image_size, 4, r.image.data(), image_size * 4)) {
+		std::cerr << "check: error writing golden image " << golden << std::endl;
+		passed = false;
+	    }
+	}
+	if (!check.baseline.empty()) {
+	    std::ofstream out(check.baseline);
+	    for (auto & r: renders) out << r.filename << " " << r.time << "\n";
+	}
+	return passed;
+    }
+
+    std::map<std::string, double> baseline;
+    if (!check.baseline.empty()) {
+	std::ifstream in(check.baseline);
+	if (!in) {
+	    std::cout << "FAIL no baseline at " << check.baseline << std::endl;
+	    passed = false;
+	}
+	std::string name;
+	double time;
+	while (in >> name >> time) baseline[name] = time;
+    }
+
+    double log_ratios = 0;
+    int timed = 0;
+    for (auto & r: renders) {
+	std::vector<uint8_t> golden;
+	int gw, gh, max_diff;
+
+	if (!read_png_to_uint8(check.golden_dir + "/" + r.filename, golden, gw, gh)) {
+	    std::cout << "FAIL " << r.filename << ": missing golden image" << std::endl;
+	    passed = false;
+	}
+	else if (golden.size() != r.image.size()) {
+	    std::cout << "FAIL " << r.filename << ": golden image is " << gw << "x" << gh << std::endl;
+	    passed = false;
+	}
+	else {
+	    const int mismatched = compare_uint8(r.image, golden, check.tolerance, max_diff);
+	    std::cout << (mismatched ? "FAIL " : "ok   ") << r.filename << ": " << mismatched
+		      << " pixels over tolerance, max difference " << max_diff << std::endl;
+	    if (mismatched) passed = false;
+	}
+
+	if (check.baseline.empty()) continue;
+	auto base = baseline.find(r.filename);
+	if (base == baseline.end()) {
+	    std::cout << "FAIL " << r.filename << ": not in the baseline" << std::endl;
+	    passed = false;
+	    continue;
+	}
+	const double slowdown = 100 * (r.time - base -> second) / base -> second;
+	const bool slow = slowdown > check.max_scene_slowdown;
+	std::cout << (slow ? "FAIL " : "ok   ") << r.filename << ": " << r.time << " units, baseline "
+		  << base -> second << " (" << (slowdown >= 0 ? "+" : "") << slowdown << "%)" << std::endl;
+	if (slow) passed = false;
+	log_ratios += std::log(r.time / base -> second);
+	++timed;
+    }
+
+    if (timed > 0) {
+	const double slowdown = 100 * (std::exp(log_ratios / timed) - 1);
+	const bool slow = slowdown > check.max_slowdown;
+	std::cout << (slow ? "FAIL " : "ok   ") << "all " << timed << " scenes: geometric mean "
+		  << (slowdown >= 0 ? "+" : "") << slowdown << "% over the baseline" << std::endl;
+	if (slow) passed = false;
+    }
+
+    return passed;
+}
+
+int main(int argc, char *argv[])
+{
+    check_parameters check;
+    check.tolerance = 0;
+    check.max_slowdown = 25;
+    check.max_scene_slowdown = 100;
+    check.runs = 5;
+    check.min_seconds = 0.25;
+    check.record = false;
+
+    for (int i = 1; i < argc; i++) {
+	if (strncmp(argv[i], "--golden=", 9) == 0) check.golden_dir = argv[i] + 9;
+	else if (strncmp(argv[i], "--tolerance=", 12) == 0) check.tolerance = atoi(argv[i] + 12);
+	else if (strncmp(argv[i], "--baseline=", 11) == 0) check.baseline = argv[i] + 11;
+	else if (strncmp(argv[i], "--max-slowdown=", 15) == 0) check.max_slowdown = atof(argv[i] + 15);
+	else if (strncmp(argv[i], "--max-scene-slowdown=", 21) == 0) check.max_scene_slowdown = atof(argv[i] + 21);
+	else if (strncmp(argv[i], "--runs=", 7) == 0) check.runs = std::max(1, atoi(argv[i] + 7));
+	else if (strncmp(argv[i], "--min-time=", 11) == 0) check.min_seconds = atof(argv[i] + 11);
+	else if (strcmp(argv[i], "--record") == 0) check.record = true;
+	else {
+	    check.golden_dir.clear();
+	    break;
+	}
+    }
+    if (check.golden_dir.empty()) {
+	std::cerr << "usage: " << argv[0] << " --golden=dir [--tolerance=N] [--baseline=file] [--max-slowdown=percent]"
+		  << " [--max-scene-slowdown=percent] [--runs=N] [--min-time=seconds] [--record]" << std::endl;
+	return 1;
+    }
+
+    //the program's own size and scenes, with the checkerboard texture it uses by default
+    const texture tex = checkerboard_texture();
+    std::vector<render_record> renders;
+
+    const bool timed = !check.baseline.empty();
+    for (auto & s: make_scenes(image_size, image_size, 0, tex, true)) {
+	render_record r = {s.filename, {}, 0};
+	const scene_output image = render_image(s.scene, s.objects);
+	write_matrix_to_uint8(image.R, image.B, image.G, image.A, r.image);
+
+	if (timed) {
+	    //timed on one thread, so the times compare across machines with different core counts
+	    s.scene.threads = 1;
+	    r.time = relative_time([&]() { render_image(s.scene, s.objects); }, check.runs, check.min_seconds);
+	}
+	renders.push_back(r);
+    }
+
+    return check_renders(renders, check) ? 0 : 1;
+}
@@ -5,47 +5,531 @@
  *  is a simplified version of the Linux Bash Shell.
  */
 
+#define _GNU_SOURCE //pipe2, splice, tee, wait4, sched_setaffinity, F_DUPFD_CLOEXEC, FNM_PERIOD
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <wait.h>
 #include <errno.h>
+#include <ctype.h>
 #include <limits.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <termios.h>
 
 #define ARG_MAX 2048 //defines the maximum string length accepted by ssi prompt
 //Other defines used, but specified in limits.h include:
 // HOST_NAME_MAX
 // PATH_MAX
 
+//epoll instance of the interactive event loop, -1 in script mode
+int event_fd = -1;
+
+//signalfd receiving SIGCHLD and SIGINT, which are blocked in the shell and unblocked in children
+int signal_fd = -1;
+
+//0 if stdin could not be added to epoll (a regular file), in which case it is always ready
+int stdin_polled = 0;
+
+//epoll data of the event sources; captured job output is ((uint64_t)pid << 1) | stream
+#define EVENT_STDIN 0
+#define EVENT_SIGNAL 1
+#define EVENT_CONTROL 2 //the listening control socket, where captured stdout of pid 1 would be, which is never a job
+#define EVENT_CLIENT (1ULL << 63) //ORed with the descriptor of a control client
+
+//stdin if the interactive shell runs on a terminal, which it hands to foreground jobs; -1 otherwise
+int shell_terminal = -1;
+
+//terminal modes of the shell, restored whenever it takes the terminal back from a job
+struct termios shell_modes;
+
+//posix_spawn can only hand the terminal to the new process group from glibc 2.35 on,
+//and only change the directory of the new process from glibc 2.29 on
+#define SPAWN_TCSETPGRP 0
+#define SPAWN_CHDIR 0
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 35)
+#undef SPAWN_TCSETPGRP
+#define SPAWN_TCSETPGRP 1
+#endif
+#if __GLIBC_PREREQ(2, 29)
+#undef SPAWN_CHDIR
+#define SPAWN_CHDIR 1
+#endif
+#endif
+
+//process group a pipeline is launched into by launch_pipeline
+#define GROUP_SHELL 0 //the shell's own, as in script mode
+#define GROUP_BACKGROUND 1 //a new group, which does not receive the ^C typed at the terminal
+#define GROUP_FOREGROUND 2 //a new group, given the terminal while it runs
+
+#define KILL_TIMEOUT 3 //seconds a job has to exit after kill sends SIGTERM, before it is sent SIGKILL
+
+#define PROBE_TIMEOUT 2 //seconds cd waits for a directory to open before giving up on it
+
+/*
+ * An open of a directory run on a helper thread, so a hung network mount cannot freeze the shell.
+ * If the shell stops waiting the probe is abandoned, and the thread frees it (closing the
+ * descriptor) whenever the open finally returns.
+ */
+typedef struct dir_probe {
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    char path[PATH_MAX];
+    int fd; //the opened directory, -1 on error
+    int error;
+    int done;
+    int abandoned;
+} dir_probe;
+
+//set by --fork to launch commands with fork and execv instead of posix_spawn
+int launch_with_fork = 0;
+
+//exit status of the last foreground command, in the form reported by script mode
+int last_status = 0;
+
+extern char **environ;
+
+//set by --job-log, every background process that terminates is appended to it as a JSON line
+FILE *job_log = NULL;
+
+#define CONTROL_MAX_CLIENTS 16 //connections the control socket serves at once
+
+typedef struct control_client {
+    int fd;
+    char buffer[ARG_MAX]; //start of a request line not yet complete
+    int buffered;
+} control_client;
+
+/*
+ * The Unix socket set by --control. Every client is sent the job events (spawned, stopped,
+ * continued, exited) as JSON lines, and may send requests (submit, kill, status) as JSON lines,
+ * each answered by a reply line.
+ */
+typedef struct control_socket {
+    int fd; //listening socket, -1 without --control
+    const char *path;
+    control_client clients[CONTROL_MAX_CLIENTS];
+    int num_clients;
+} control_socket;
+
+control_socket control = { .fd = -1 };
+
+#define PATH_BUCKETS 256 //buckets in the command hash cache, a power of two
+
+typedef struct path_entry {
+    struct path_entry *next;
+    char *name;
+    char *path; //absolute path name resolved to, stored after name in the same allocation
+    int hits;
+} path_entry;
+
+/*
+ * Resolved locations of commands, like the hash builtin of bash, so PATH is not searched on every
+ * launch. The cache is emptied whenever PATH differs from the value the entries were resolved with.
+ */
+typedef struct path_cache {
+    path_entry *buckets[PATH_BUCKETS];
+    char *path_env;
+    int count;
+} path_cache;
+
+path_cache command_cache;
+
+#define GLOB_CACHE_MIN 256 //entries a directory needs before its listing is worth caching
+#define GLOB_CACHE_MAX 16 //directories whose listings are cached at once
+
+//a record returned by the getdents64 system call
+typedef struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} linux_dirent64;
+
+/*
+ * The entries of a directory as read by getdents64: names holds, for each entry, its d_type
+ * byte followed by its NUL terminated name.
+ */
+typedef struct dir_listing {
+    dev_t dev;
+    ino_t ino;
+    int watch; //inotify watch descriptor of a cached listing, -1 if the listing is not cached
+    char *names;
+    size_t len;
+    int count;
+    unsigned last_used;
+} dir_listing;
+
+/*
+ * Listings of the large directories globs have been matched against, so a glob over tens of
+ * thousands of files does not read the directory again on every command. Each is watched with
+ * inotify and dropped as soon as an entry is created, deleted or renamed in it.
+ */
+typedef struct glob_cache {
+    int enabled; //cleared by --no-glob-cache
+    int inotify_fd; //-1 until the first directory is cached, or if inotify is not available
+    dir_listing entries[GLOB_CACHE_MAX];
+    int count;
+    unsigned clock; //last_used of the most recent lookup
+} glob_cache;
+
+glob_cache listing_cache = { .enabled = 1, .inotify_fd = -1 };
+
+#define HISTORY_FILE ".ssi_history" //in $HOME, unless $SSI_HISTORY names another file
+#define HISTORY_SHOW 20 //entries listed by history and history -s
+#define HISTORY_COMPACT_MIN 1000 //entries before duplicates are worth compacting away
+
+typedef struct history_entry {
+    uint64_t key; //the first 8 bytes of the command, big-endian and zero padded, for quick comparisons
+    size_t offset; //start of the command in the log
+    unsigned len; //without the newline
+} history_entry;
+
+/*
+ * Command history, shared by every ssi session of the user. The log is a text file of one command
+ * per line that sessions only ever append to, under flock. It is opened at startup but only mapped
+ * and indexed the first time history is used, and only the part added since is indexed later.
+ * Prefix searches use a second index with one entry per distinct command, sorted by text.
+ * Compaction rewrites the log without duplicates in a child process and renames it into place;
+ * sessions notice the new inode and reopen it.
+ */
+typedef struct history_log {
+    char *path;
+    int fd; //opened with O_APPEND, -1 if there is no history
+    ino_t inode; //of the mapped log
+    char *map; //the log mapped read-only, NULL until history is first used
+    size_t mapped;
+    size_t indexed; //bytes of the log in entries
+    history_entry *entries; //every command in the order entered
+    int count;
+    int capacity;
+    history_entry *sorted; //the most recent entry of each distinct command, sorted by text
+    int num_sorted;
+    int sorted_upto; //entries before this one are in sorted
+    pid_t compactor; //pid of the compaction child, 0 if none is running
+} history_log;
+
+history_log history;
+
+typedef struct script_job {
+    pid_t pid;
+    int line;
+} script_job;
+
+//a run of the command being benchmarked
+typedef struct bench_run {
+    pid_t pid;
+    int index;
+    struct timespec started;
+} bench_run;
+
+//one line of input plus an argv with a slot for every character, the most parse_input can need before expansion
+#define ARENA_SIZE (ARG_MAX + sizeof(char*) * (ARG_MAX + 1) + 3 * sizeof(void*))
+
+/*
+ * Bump allocator for everything that lives for one command line. It is reset before every line,
+ * so reading and parsing a command does not call malloc or free. A glob can expand to more than
+ * fits; the arena then moves on to a block twice the size, and reset_arena keeps only the largest.
+ */
+typedef struct arena {
+    char *base; //the block allocations come from, its first word points to the previous block
+    size_t size;
+    size_t used;
+} arena;
+
+/*
+ * Options given to bg before the command, applied in the child between fork and exec:
+ * --cpus=LIST pins the job to the listed CPUs, --mem=SIZE caps its address space,
+ * --nice=N lowers its priority by N and --cgroup=DIR moves it into a cgroup v2 directory.
+ * --capture keeps the job's stdout and stderr in ring buffers shown by bgout, and --spill=FILE
+ * moves captured output to FILE once a ring buffer overflows.
+ */
+typedef struct job_limits {
+    int capture;
+    char *spill; //NULL for none
+    int has_cpus;
+    cpu_set_t cpus;
+    rlim_t mem; //bytes, 0 for no limit
+    int has_nice;
+    int nice;
+    char *cgroup; //NULL for none
+} job_limits;
+
+#define RING_SIZE (64 * 1024) //bytes of captured output kept per stream of a job
+
+/*
+ * The most recent output of one stream of a captured job. Memory is fixed at RING_SIZE however
+ * much the job writes: older bytes are overwritten, or with --spill, everything from the first
+ * overflow on goes to the spill file instead.
+ */
+typedef struct ring_buffer {
+    char *data; //NULL if the job is not captured
+    size_t total; //bytes the stream has produced
+    size_t written; //bytes ever stored, the next byte goes to data[written % RING_SIZE]
+    size_t len; //bytes held, at most RING_SIZE
+    size_t dropped; //bytes overwritten
+    size_t spilled; //bytes written to the spill file
+    int spilling; //the buffer has overflowed and output is spliced to the spill file
+} ring_buffer;
+
+#define POOL_MAX_WORKERS 64 //idle workers a pool may keep
+
+#define BG_FINISHED_MAX 16 //terminated captured jobs whose output is kept for bgout
+
+#define BG_BUCKETS_MIN 64 //initial size of the pid hash table, always a power of two
+
 typedef struct bg_process {
-    struct bg_process *next;
+    struct bg_process *next; //launch order, used by bglist
+    struct bg_process *prev;
+    struct bg_process *hash_next; //next process in the same pid bucket
     pid_t pid;
+    pid_t pgid; //process group of every stage of the job, 0 if it stayed in the shell's
+    int stopped;
+    int kill_signal; //SIGTERM once kill has been used on the job, SIGKILL once that timed out, otherwise 0
+    struct timespec kill_sent; //CLOCK_MONOTONIC time of the SIGTERM
+    struct timespec started; //CLOCK_MONOTONIC, for the wall time of the job
+    time_t launched; //wall clock time the job was started at, for display
+    job_limits limits; //applied again when a queued job is started
+    int output[2]; //read ends of the captured stdout and stderr pipes, -1 when not captured
+    ring_buffer captured[2];
+    int spill_fd;
     char *path; 
     char **args;
 } bg_process;
 
+/*
+ * A pool of workers started ahead of time by pool create, so the startup cost of a command (exec,
+ * dynamic linking, an interpreter loading its modules) is paid before the work arrives. Each worker
+ * is the pooled command, already running with its stdin a pipe from the shell, and handles one
+ * request: pool run writes its args as one line to an idle worker and closes the pipe, and starts
+ * a replacement straight away. A pooled command must therefore take its work from stdin.
+ */
+typedef struct pool_worker {
+    pid_t pid;
+    int request_fd; //write end of the worker's stdin
+} pool_worker;
+
+typedef struct worker_pool {
+    struct worker_pool *next;
+    char *name;
+    char *path; //directory the workers run in
+    char **args;
+    int size; //idle workers kept
+    pool_worker *idle; //oldest first
+    int num_idle;
+    int runs;
+    int cold; //runs that found no idle worker and had to start one
+    int lost; //idle workers that exited before they were given work
+} worker_pool;
+
+/*
+ * Background processes are kept in launch order in a doubly linked list and indexed by pid in a
+ * chained hash table, so insert, lookup and remove are O(1) regardless of the number of jobs.
+ */
 typedef struct bg_process_list {
     bg_process *head;
+    bg_process *tail;
+    bg_process **buckets;
+    int num_buckets;
+    int count;
+    int max_running; //job slots set with bg -j, 0 for no limit
+    bg_process *queue_head; //FIFO of commands waiting for a job slot, pid is 0 until started
+    bg_process *queue_tail;
+    int queued;
+    bg_process *finished; //terminated captured jobs, newest first, linked by next
+    int num_finished;
+    int terminating; //jobs sent SIGTERM by kill that may still need SIGKILL
+    worker_pool *pools;
 } bg_process_list;
 
+void init_arena(arena *mem, const size_t size);
+void* arena_alloc(arena *mem, size_t size);
+void* arena_realloc(arena *mem, void *ptr, const size_t old_size, const size_t size);
+void reset_arena(arena *mem);
 bg_process_list* init_bg_process_list();
-bg_process* init_bg_process(const pid_t pid, const char *path, char **args);
-void insert_bg_process(bg_process_list *bg_list, const pid_t pid, const char *path, char **args);
+bg_process* init_bg_process(const pid_t pid, const char *path, char **args, const job_limits *limits);
+unsigned bg_bucket(const bg_process_list *bg_list, const pid_t pid);
+void grow_bg_process_list(bg_process_list *bg_list);
+bg_process* find_bg_process(const bg_process_list *bg_list, const pid_t pid);
+void link_bg_process(bg_process_list *bg_list, bg_process *new);
+void queue_bg_process(bg_process_list *bg_list, const char *path, char **args, const job_limits *limits);
+void start_queued_bg_processes(bg_process_list *bg_list);
+void set_bg_job_slots(bg_process_list *bg_list, char **args);
 void remove_bg_process(bg_process_list *bg_list, bg_process *rem);
 void del_bg_process(bg_process *rem);
+pid_t launch_bg_process(bg_process *job);
+int submit_bg_process(bg_process_list *bg_list, const char *path, char **args, pid_t *pid);
+size_t capture_bg_output(bg_process *job, const int stream);
+int store_ring_buffer(ring_buffer *ring, const int fd, const int overwrite);
+int write_ring_buffer(const ring_buffer *ring, const int fd);
+void stop_spilling(bg_process *job);
+void keep_finished_bg_process(bg_process_list *bg_list, bg_process *job);
+bg_process* find_captured_bg_process(const bg_process_list *bg_list, const pid_t pid);
+void print_bg_output(bg_process_list *bg_list, char **args);
 void print_bg_process(const bg_process *process);
-void check_bg_process_list(bg_process_list *bg_list);
+double elapsed_seconds(const struct timespec *since);
+int read_proc_usage(const pid_t pid, double *cpu, long *maxrss);
+void print_bg_usage(const bg_process *process);
+void write_json_string(FILE *out, const char *str);
+void write_job_json(FILE *out, const bg_process *process);
+void log_bg_process(const bg_process *process, const int status, const struct rusage *usage, const double wall);
+const char* job_state(const bg_process *process);
+void send_job_event(const char *event, const bg_process *process, const int status, const struct rusage *usage,
+		    const double wall);
+void set_bg_stopped(bg_process *process, const int stopped);
+int report_bg_process(bg_process_list *bg_list, const pid_t pid, const int status, const struct rusage *usage,
+		      int newline_first);
+int report_bg_stop(bg_process_list *bg_list, const pid_t pid, const int status, int newline_first);
+int check_bg_process_list(bg_process_list *bg_list, int at_prompt);
 void print_bg_list(const bg_process_list *bg_list);
 void print_path(const char *user, const char *host, const char *path);
-void get_input(char *input, int inputsize);
-char** parse_input(char *args_string);
+void init_event_loop();
+void reclaim_terminal();
+void drain_sigint();
+void open_control_socket(const char *path);
+void close_control_socket();
+void accept_control_clients();
+int find_control_client(const int fd);
+void drop_control_client(const int i);
+int send_control(const int fd, const char *line, const size_t len);
+const char* read_json_string(const char *c, char *out, const size_t size);
+int json_field(const char *line, const char *key, char *value, const size_t size);
+int handle_control_request(const int fd, const char *line, char *path, bg_process_list *bg_list);
+int read_control_client(const int fd, char *path, bg_process_list *bg_list);
+int get_input(char *input, int inputsize, bg_process_list *bg_list, const char *user, const char *host, char *path);
+char** parse_input(char *args_string, arena *mem);
+char* end_of_word(char *c);
+const char* lookup_variable(const char **c, char *special, char *name);
+char* expand_word(const char *word, arena *mem, char **pattern);
+int has_glob(const char *word);
+void drop_cached_listing(dir_listing *listing);
+void check_listing_cache();
+int read_dir_listing(const int fd, dir_listing *listing);
+dir_listing* list_directory(const char *dir);
+int compare_strings(const void *a, const void *b);
+int expand_glob(const char *pattern, arena *mem, char ***matches, int *count, int *capacity);
+char** expand_args(char **args, arena *mem);
+int signal_bg_process(const bg_process *job, const int sig);
+bg_process* find_job_arg(const bg_process_list *bg_list, const char *arg, const int stopped_only, const char *name);
 void kill_process(bg_process_list *bg_list, char **args);
+int next_kill_timeout(const bg_process_list *bg_list);
+void escalate_kills(bg_process_list *bg_list);
+void stop_process(bg_process_list *bg_list, char **args);
+void continue_process(bg_process_list *bg_list, char **args);
+void foreground_process(bg_process_list *bg_list, char **args);
+void stop_foreground(bg_process_list *bg_list, const char *path, char **args, const pid_t pid, const pid_t pgid);
+int normalize_path(char *path);
+void* run_dir_probe(void *arg);
+int open_directory(const char *path, int *error);
 void change_directory(char *path, char **args);
+unsigned path_bucket(const char *name);
+void clear_command_cache();
+void forget_command(const char *name);
+int search_path(const char *name, char *resolved);
+const char* lookup_command(const char *name);
+void hash_command(char **args);
+int parse_cpu_list(const char *list, cpu_set_t *cpus);
+int parse_job_options(char **args, job_limits *limits);
+int apply_job_limits(const job_limits *limits);
+void init_job_child(const pid_t pgid, const int foreground);
+pid_t launch_process(char **args, const int in_fd, const int out_fd, const int err_fd,
+		     const pid_t pgid, const int foreground, const job_limits *limits, const char *dir);
+void relay_tee(const int in, const int out, const int *files, const int num_files);
+int parse_tee_options(char **args, int *append, int *ignore_interrupts);
+pid_t launch_tee(char **args, const int in_fd, const int out_fd, const int err_fd,
+		 const pid_t pgid, const int foreground, const job_limits *limits, const char *dir);
+int count_stages(char **args);
+pid_t launch_pipeline(char **args, pid_t *pids, const job_limits *limits, const char *dir, const int *output,
+		      const int group, pid_t *pgid);
+int exit_status(const int status);
+int compare_doubles(const void *a, const void *b);
+void print_bench_row(const char *name, double *values, const int n);
+void bench_command(char **args, bg_process_list *bg_list);
+void open_history();
+void reset_history();
+void add_history(const char *line);
+int load_history();
+int compare_history(const void *a, const void *b);
+int compare_history_age(const void *a, const void *b);
+uint64_t history_key(const history_entry *entry, const int depth);
+void radix_sort_history(history_entry *entries, const int n, const int depth);
+void sort_history();
+const history_entry* search_history(const char *prefix, const size_t len, int *first, int *last);
+void compact_history();
+void history_command(char **args);
+int expand_history(char *input, const int inputsize);
+worker_pool* find_pool(const bg_process_list *bg_list, const char *name);
+int start_pool_worker(worker_pool *pool);
+void create_pool(bg_process_list *bg_list, const char *path, char **args);
+void run_pool(bg_process_list *bg_list, char **args);
+void destroy_pool(bg_process_list *bg_list, worker_pool *pool);
+void forget_pool_worker(bg_process_list *bg_list, const pid_t pid);
+void print_pools(const bg_process_list *bg_list);
+int is_tracked_child(const bg_process_list *bg_list, const pid_t pid, const pid_t pgid);
+int check_bg_list(bg_process_list *bg_list);
+void pool_command(bg_process_list *bg_list, const char *path, char **args);
+int is_builtin(char **args);
 int execute(char **args, char *path, bg_process_list *bg_list);
+int script_reap(script_job *running, int *num_running, const char *name, bg_process_list *bg_list, const int block);
+void drain_bg_queue(bg_process_list *bg_list);
+int run_script(const char *script, const size_t length, const char *name, const int max_jobs,
+	       char *path, bg_process_list *bg_list, arena *mem);
+int run_script_file(const char *filename, const int max_jobs, char *path, bg_process_list *bg_list, arena *mem);
 
 int main(int argc, char** argv) {
+    char *command = NULL; //script text given with -c
+    char *script_file = NULL;
+    char *control_path = NULL;
+    int max_jobs = 1;
+
+    for (int i = 1; i < argc; ++i) {
+	if (!strcmp(argv[i], "--fork")) launch_with_fork = 1;
+	else if (!strcmp(argv[i], "--no-glob-cache")) listing_cache.enabled = 0;
+	else if (!strcmp(argv[i], "-c") && (i + 1 < argc)) command = argv[++i];
+	else if (!strcmp(argv[i], "-j") && (i + 1 < argc)) max_jobs = atoi(argv[++i]);
+	else if (!strcmp(argv[i], "--control") && (i + 1 < argc)) control_path = argv[++i];
+	else if (!strcmp(argv[i], "--job-log") && (i + 1 < argc)) {
+	    job_log = fopen(argv[++i], "ae"); //close-on-exec, so launched commands do not inherit it
+	    if (job_log == NULL) {
+		fprintf(stderr, "ssi: %s: %s\n", argv[i], strerror(errno));
+		exit(1);
+	    }
+	}
+	else if ((argv[i][0] != '-') && (script_file == NULL)) script_file = argv[i];
+	else {
+	    fprintf(stderr, "usage: %s [--fork] [--no-glob-cache] [--job-log file] [--control socket] [-j jobs] [-c command | file]\n", argv[0]);
+	    exit(1);
+	}
+    }
+    if ((control_path != NULL) && ((command != NULL) || (script_file != NULL))) {
+	fprintf(stderr, "ssi: --control is only available in the interactive shell\n");
+	exit(1);
+    }
+    if (max_jobs < 1) max_jobs = 1;
+
     //getting shell details
     char *username= getlogin();
     char *hostname = (char*)malloc(HOST_NAME_MAX);
@@ -60,33 +544,139 @@ int main(int argc, char** argv) {
 	exit(1);
     }
 
-    print_path(username, hostname, pathname);
-
     bg_process_list *bg_list = init_bg_process_list();    
 
+    open_history();
+
+    arena line_arena; //reused for every command of the session
+    init_arena(&line_arena, ARENA_SIZE);
+
+    //script mode: no prompt, the shell exits with the status of the last command
+    if ((command != NULL) || (script_file != NULL)) {
+	int status = (command != NULL) ?
+	    run_script(command, strlen(command), "-c", max_jobs, pathname, bg_list, &line_arena) :
+	    run_script_file(script_file, max_jobs, pathname, bg_list, &line_arena);
+	while (bg_list -> pools != NULL) destroy_pool(bg_list, bg_list -> pools);
+	free(hostname);
+	free(pathname);
+	return status;
+    }
+
+    init_event_loop();
+    if (control_path != NULL) open_control_socket(control_path);
+
+    print_path(username, hostname, pathname);
+
     for(;;) {
-	char *user_args = (char*)malloc(ARG_MAX);
-	get_input(user_args, ARG_MAX);
+	reset_arena(&line_arena);
+	char *user_args = arena_alloc(&line_arena, ARG_MAX);
+	//background jobs are reaped and their output relayed by get_input as events arrive, while it waits for a line
+	if (get_input(user_args, ARG_MAX, bg_list, username, hostname, pathname) == -1) break;
+	if (expand_history(user_args, ARG_MAX) == -1) {
+	    print_path(username, hostname, pathname);
+	    continue;
+	}
+	add_history(user_args); //before parse_input, which tokenizes the line in place
 
-	char **args = parse_input(user_args);
+	char **args = parse_input(user_args, &line_arena);
 
-	//checking if any background child processes have terminated
-	if (bg_list -> head != NULL) check_bg_process_list(bg_list);
-	
 	if (execute(args, pathname, bg_list)) break;
 	print_path(username, hostname, pathname);
+    }
 
-	for (int i = 0; args[i] != NULL; ++i) free(args[i]);
-	free(args);
-	free(user_args);    
+    //like the kernel does for orphaned process groups, so stopped jobs are not left behind forever
+    for (bg_process *temp = bg_list -> head; temp != NULL; temp = temp -> next) {
+	if (!temp -> stopped) continue;
+	signal_bg_process(temp, SIGHUP);
+	signal_bg_process(temp, SIGCONT);
     }
+    while (bg_list -> pools != NULL) destroy_pool(bg_list, bg_list -> pools);
+    close_control_socket();
     
+    reset_arena(&line_arena);
+    free(line_arena.base);
     free(hostname);
     free(pathname);
     return 0;
 }
 
 
+/*
+ * init_arena
+ *
+ * Allocates the backing memory of an arena of the given size.
+ */
+void init_arena(arena *mem, const size_t size) {
+    mem -> base = malloc(size);
+    mem -> size = size;
+    mem -> used = sizeof(char*);
+    if (mem -> base == NULL) {
+	fprintf(stderr, "ssi: init_arena: error allocating %zu bytes\n", size);
+	exit(1);
+    }
+    *(char**)mem -> base = NULL;
+}
+
+/*
+ * arena_alloc
+ *
+ * Returns size bytes from the arena, aligned for pointers. The memory is valid until reset_arena.
+ * When the current block is full a new one is started, earlier allocations stay where they are.
+ */
+void* arena_alloc(arena *mem, size_t size) {
+    size_t start = (mem -> used + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    if (start + size > mem -> size) {
+	size_t grown = 2 * mem -> size;
+	if (grown < size + 2 * sizeof(void*)) grown = size + 2 * sizeof(void*);
+	char *block = malloc(grown);
+	if (block == NULL) {
+	    fprintf(stderr, "ssi: arena_alloc: error, out of line memory\n");
+	    exit(1);
+	}
+	*(char**)block = mem -> base;
+	mem -> base = block;
+	mem -> size = grown;
+	start = sizeof(void*);
+    }
+    mem -> used = start + size;
+    return mem -> base + start;
+}
+
+/*
+ * arena_realloc
+ *
+ * Resizes ptr, an allocation of old_size bytes from the arena (or NULL), to size bytes. The most
+ * recent allocation grows in place while the block has room, any other is copied to a new one;
+ * the old copy is released with the rest of the arena by reset_arena.
+ */
+void* arena_realloc(arena *mem, void *ptr, const size_t old_size, const size_t size) {
+    if ((ptr != NULL) && ((char*)ptr + old_size == mem -> base + mem -> used) &&
+	((size_t)((char*)ptr - mem -> base) + size <= mem -> size)) {
+	mem -> used = ((char*)ptr - mem -> base) + size;
+	return ptr;
+    }
+    void *moved = arena_alloc(mem, size);
+    if (ptr != NULL) memcpy(moved, ptr, (old_size < size) ? old_size : size);
+    return moved;
+}
+
+/*
+ * reset_arena
+ *
+ * Releases everything allocated from the arena at once. Blocks before the current one, which is
+ * the largest, are freed.
+ */
+void reset_arena(arena *mem) {
+    char *prev = *(char**)mem -> base;
+    while (prev != NULL) {
+	char *next = *(char**)prev;
+	free(prev);
+	prev = next;
+    }
+    *(char**)mem -> base = NULL;
+    mem -> used = sizeof(char*);
+}
+
 /*
  * init_bg_process_list
  *
@@ -95,256 +685,3765 @@ int main(int argc, char** argv) {
 bg_process_list* init_bg_process_list() {
     bg_process_list *temp = malloc(sizeof(bg_process_list));
     temp -> head = NULL;
+    temp -> tail = NULL;
+    temp -> num_buckets = BG_BUCKETS_MIN;
+    temp -> buckets = calloc(temp -> num_buckets, sizeof(bg_process *));
+    temp -> count = 0;
+    temp -> max_running = 0;
+    temp -> queue_head = NULL;
+    temp -> queue_tail = NULL;
+    temp -> queued = 0;
+    temp -> finished = NULL;
+    temp -> num_finished = 0;
+    temp -> terminating = 0;
+    temp -> pools = NULL;
+    return temp;
+}
+
+/*
+ * bg_bucket
+ *
+ * Returns the hash bucket of pid. Fibonacci hashing spreads the mostly sequential pids over the table.
+ */
+unsigned bg_bucket(const bg_process_list *bg_list, const pid_t pid) {
+    return ((unsigned)pid * 2654435769u) & (bg_list -> num_buckets - 1);
+}
+
+/*
+ * grow_bg_process_list
+ *
+ * Doubles the number of hash buckets and rehashes every process, keeping the load factor below one.
+ */
+void grow_bg_process_list(bg_process_list *bg_list) {
+    free(bg_list -> buckets);
+    bg_list -> num_buckets *= 2;
+    bg_list -> buckets = calloc(bg_list -> num_buckets, sizeof(bg_process *));
+
+    for (bg_process *temp = bg_list -> head; temp != NULL; temp = temp -> next) {
+	unsigned b = bg_bucket(bg_list, temp -> pid);
+	temp -> hash_next = bg_list -> buckets[b];
+	bg_list -> buckets[b] = temp;
+    }
+}
+
+/*
+ * find_bg_process
+ *
+ * Returns the bg_process with the given pid, or NULL if pid is not a background process.
+ */
+bg_process* find_bg_process(const bg_process_list *bg_list, const pid_t pid) {
+    bg_process *temp = bg_list -> buckets[bg_bucket(bg_list, pid)];
+    while ((temp != NULL) && (temp -> pid != pid)) temp = temp -> hash_next;
     return temp;
 }
 
 /*
  * init_bg_process
  *
- * Initializes a bg_process struct with the pid, path, and args values provided as input.
+ * Initializes a bg_process struct with the pid, path, args and job limits (which may be NULL)
+ * provided as input.
  */
-bg_process* init_bg_process(const pid_t pid, const char *path, char **args) {
-    bg_process *temp = (bg_process *)malloc(sizeof(bg_process));
+bg_process* init_bg_process(const pid_t pid, const char *path, char **args, const job_limits *limits) {
+    //the struct, the argv array, path, every arg, the cgroup and the spill file share one allocation,
+    //freed by del_bg_process
+    int argc = 0;
+    size_t text = strlen(path) + 1;
+    for (argc = 0; args[argc] != NULL; ++argc) text += strlen(args[argc]) + 1;
+    if ((limits != NULL) && (limits -> cgroup != NULL)) text += strlen(limits -> cgroup) + 1;
+    if ((limits != NULL) && (limits -> spill != NULL)) text += strlen(limits -> spill) + 1;
+
+    bg_process *temp = (bg_process *)malloc(sizeof(bg_process) + sizeof(char*) * (argc + 1) + text);
     temp -> next = NULL;
+    temp -> prev = NULL;
+    temp -> hash_next = NULL;
     temp -> pid = pid;
-    temp -> path = (char*)malloc(sizeof(char *) * strlen(path));
-    temp -> args = (char**)malloc(sizeof(char **) * ARG_MAX);    
-    memcpy(temp -> path, path, strlen(path));
-    
-    int i;
-    for (i = 0; args[i] != NULL; ++i) {
-	temp -> args[i] = (char*)malloc(strlen(args[i]));
-	strcpy(temp -> args[i], args[i]);
+    temp -> pgid = 0;
+    temp -> stopped = 0;
+    temp -> kill_signal = 0;
+    temp -> args = (char**)(temp + 1);
+
+    char *c = (char*)(temp -> args + argc + 1);
+    temp -> path = c;
+    c = stpcpy(c, path) + 1;
+    for (int i = 0; i < argc; ++i) {
+	temp -> args[i] = c;
+	c = stpcpy(c, args[i]) + 1;
+    }
+    temp -> args[argc] = NULL;
+
+    if (limits != NULL) temp -> limits = *limits;
+    else memset(&temp -> limits, 0, sizeof(job_limits));
+    temp -> output[0] = -1;
+    temp -> output[1] = -1;
+    memset(temp -> captured, 0, sizeof(temp -> captured));
+    temp -> spill_fd = -1;
+    if (temp -> limits.cgroup != NULL) {
+	temp -> limits.cgroup = c;
+	c = stpcpy(c, limits -> cgroup) + 1;
+    }
+    if (temp -> limits.spill != NULL) {
+	temp -> limits.spill = c;
+	strcpy(c, limits -> spill);
     }
-    temp -> args[i] = NULL;
-    temp -> args = realloc(temp -> args, sizeof(char*) * i + 1);
 
     return temp;
 }
 
 /*
- * insert_bg_process
+ * link_bg_process
  *
- * Initializes a bg_process with the provided pid, path, and args values by calling init_bg_process
- * and inserts the bg_process struct at the end of the bg_list linked list provided as input.
+ * Adds an initialized bg_process with a valid pid to the end of bg_list and to its pid bucket.
+ * The job's start time is taken here, so queued commands are timed from when they actually start.
+ * Control clients are sent a "spawned" event.
  */
-void insert_bg_process(bg_process_list *bg_list, const pid_t pid, const char *path, char **args) {
-    bg_process *new = init_bg_process(pid, path, args);
-    if (bg_list -> head == NULL) bg_list -> head = new;
+void link_bg_process(bg_process_list *bg_list, bg_process *new) {
+    clock_gettime(CLOCK_MONOTONIC, &new -> started);
+    new -> launched = time(NULL);
+
+    new -> next = NULL;
+    new -> prev = bg_list -> tail;
+    if (bg_list -> tail == NULL) bg_list -> head = new;
+    else bg_list -> tail -> next = new;
+    bg_list -> tail = new;
+
+    if (++bg_list -> count > bg_list -> num_buckets) grow_bg_process_list(bg_list);
     else {
-	bg_process *temp = bg_list -> head;
-	while(temp -> next != NULL) temp = temp -> next;
-	temp -> next = new;
+	unsigned b = bg_bucket(bg_list, new -> pid);
+	new -> hash_next = bg_list -> buckets[b];
+	bg_list -> buckets[b] = new;
     }
+    send_job_event("spawned", new, 0, NULL, 0);
 }
 
 /*
- * remove_bg_proces
- * 
- * Updates the prev and next pointers in bg_list to reflect the removal of 
- * the bg_process rem.
+ * queue_bg_process
+ *
+ * Appends a background command to the run queue, to be started by start_queued_bg_processes
+ * once a job slot is free.
  */
-void remove_bg_process(bg_process_list *bg_list, bg_process *rem) {
-    if (bg_list -> head == rem) bg_list -> head = rem -> next;
-    else {
-	bg_process *temp = bg_list -> head;
-	while(temp -> next != rem) temp = temp -> next;
-	temp -> next = rem -> next;
-    }
+void queue_bg_process(bg_process_list *bg_list, const char *path, char **args, const job_limits *limits) {
+    bg_process *new = init_bg_process(0, path, args, limits);
+    if (bg_list -> queue_tail == NULL) bg_list -> queue_head = new;
+    else bg_list -> queue_tail -> next = new;
+    bg_list -> queue_tail = new;
+    ++bg_list -> queued;
 }
 
 /*
- * del_bg_process
+ * start_queued_bg_processes
  *
- * Frees memory used by the input bg_process rem.
+ * Starts queued commands in submission order while job slots are free.
+ * A command that fails to launch is dropped from the queue.
  */
-void del_bg_process(bg_process *rem) {
-    free(rem -> path);
-    for (int i = 0; rem -> args[i] != NULL; ++i) free(rem -> args[i]);
-    free(rem -> args);
-    free(rem);
+void start_queued_bg_processes(bg_process_list *bg_list) {
+    while ((bg_list -> queue_head != NULL) &&
+	   ((bg_list -> max_running == 0) || (bg_list -> count < bg_list -> max_running))) {
+	bg_process *next = bg_list -> queue_head;
+	bg_list -> queue_head = next -> next;
+	if (bg_list -> queue_head == NULL) bg_list -> queue_tail = NULL;
+	--bg_list -> queued;
+
+	if (launch_bg_process(next) <= 0) {
+	    del_bg_process(next);
+	    continue;
+	}
+	link_bg_process(bg_list, next);
+	print_bg_process(next);
+	printf("has started.\n");
+    }
 }
 
 /*
- * print_bg_process
+ * set_bg_job_slots
  *
- * Prints a bg_process in the format specified in assignment description.
+ * Handles "bg -j N": at most N background processes run at once, further bg commands wait in
+ * the run queue. N = 0 removes the limit. Without N the current limit is printed.
  */
-void print_bg_process(const bg_process *process) {
-    printf("%d: ", process -> pid);
-    printf("%s/", process -> path);
-    for (int i = 0; process -> args[i] != NULL; ++i) printf("%s ", process -> args[i]);
+void set_bg_job_slots(bg_process_list *bg_list, char **args) {
+    if (args[1] == NULL) {
+	if (bg_list -> max_running == 0) printf("bg: no job slot limit\n");
+	else printf("bg: %d job slots\n", bg_list -> max_running);
+	return;
+    }
+
+    int slots = atoi(args[1]);
+    if (slots < 0) {
+	fprintf(stderr, "ssi: bg: error, invalid job slot count %s\n", args[1]);
+	return;
+    }
+    bg_list -> max_running = slots;
+    start_queued_bg_processes(bg_list);
 }
 
 /*
- * print_path
- *
- * Prints the ssi prompt in the format specified in assignment description.
+ * remove_bg_proces
+ * 
+ * Updates the prev and next pointers in bg_list and the pid bucket chain to reflect
+ * the removal of the bg_process rem.
  */
-void print_path(const char *user, const char *host, const char *path) {
-    printf("%s@%s: %s > ", user, host, path);
+void remove_bg_process(bg_process_list *bg_list, bg_process *rem) {
+    if (rem -> prev == NULL) bg_list -> head = rem -> next;
+    else rem -> prev -> next = rem -> next;
+    if (rem -> next == NULL) bg_list -> tail = rem -> prev;
+    else rem -> next -> prev = rem -> prev;
+
+    bg_process **link = &bg_list -> buckets[bg_bucket(bg_list, rem -> pid)];
+    while (*link != rem) link = &(*link) -> hash_next;
+    *link = rem -> hash_next;
+
+    if (rem -> kill_signal == SIGTERM) --bg_list -> terminating;
+    --bg_list -> count;
 }
 
 /*
- * get_input
+ * del_bg_process
  *
- * Retrieves user input from ssi prompt.
+ * Closes the captured output pipes and spill file of the input bg_process rem and frees its memory.
  */
-void get_input(char *input, const int inputsize) {
-    fgets(input, inputsize, stdin);
-    input[strlen(input) - 1] = '\0';
+void del_bg_process(bg_process *rem) {
+    for (int stream = 0; stream < 2; ++stream) {
+	if (rem -> output[stream] != -1) close(rem -> output[stream]); //also removes it from epoll
+	free(rem -> captured[stream].data);
+    }
+    if (rem -> spill_fd != -1) close(rem -> spill_fd);
+    free(rem); //path and args are part of the same allocation
 }
 
 /*
- * parse_input
+ * launch_bg_process
  *
- * convert an arg string into an array of args that is formed using the space delimeter.
+ * Starts the command of job, which is not yet in a bg_process_list, and sets its pid and process group.
+ * It runs in job -> path, the directory it was submitted from, even if it waited in the run queue
+ * while the shell changed directory.
+ * With --capture, and while the event loop runs, stdout and stderr of the job are pipes whose read
+ * ends are kept in job -> output and watched by epoll, and read into the job's ring buffers;
+ * otherwise the job writes to the terminal.
+ * Returns the pid, or -1 if the job could not be started.
  */
-char** parse_input(char *args_string) {
-    char **args = (char**)malloc(sizeof(char*) * ARG_MAX);
+pid_t launch_bg_process(bg_process *job) {
+    int out[2], err[2];
+    int capture = job -> limits.capture && (event_fd != -1);
+    if (capture && (pipe2(out, O_CLOEXEC) == -1)) capture = 0;
+    if (capture && (pipe2(err, O_CLOEXEC) == -1)) {
+	close(out[0]);
+	close(out[1]);
+	capture = 0;
+    }
 
-    char *arg = strtok(args_string, " ");
-    int i;
-    for(i=0; arg != NULL; ++i) {
-	args[i] = (char*)malloc(strlen(arg));
-	strcpy(args[i], arg);
-	
-	arg = strtok(NULL, " ");	
+    const int output[2] = { capture ? out[1] : -1, capture ? err[1] : -1 };
+    job -> pid = launch_pipeline(job -> args, NULL, &job -> limits, job -> path, capture ? output : NULL,
+				 GROUP_BACKGROUND, &job -> pgid);
+    if (!capture) return job -> pid;
+
+    close(out[1]);
+    close(err[1]);
+    job -> output[0] = out[0];
+    job -> output[1] = err[0];
+    if (job -> limits.spill != NULL) {
+	//splice cannot write to a file opened with O_APPEND, the spill file is written from its start
+	job -> spill_fd = open(job -> limits.spill, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (job -> spill_fd == -1) fprintf(stderr, "ssi: bg: %s: %s\n", job -> limits.spill, strerror(errno));
     }
-    args[i] = NULL;
-    args = realloc(args, sizeof(char*) * i + 1);
-    
-    return args;
+    for (int stream = 0; stream < 2; ++stream) {
+	job -> captured[stream].data = malloc(RING_SIZE);
+	fcntl(job -> output[stream], F_SETFL, O_NONBLOCK);
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = ((uint64_t)job -> pid << 1) | stream };
+	if ((job -> pid > 0) && (epoll_ctl(event_fd, EPOLL_CTL_ADD, job -> output[stream], &ev) == -1))
+	    fprintf(stderr, "ssi: bg: error watching output: %s\n", strerror(errno));
+    }
+    return job -> pid;
 }
 
 /*
- * change_directory
+ * submit_bg_process
  *
- * Calls the chdir() function with the path specified in **args.
- * Special path args accepted are:
- * cd .. , which changes the directory to the directory one level higher than the current direcotyr
- * cd ~ or cd (no arguments), which changes the directory to the home directory of the user, as specified by getenv("HOME")
- * cd path , which changes the directory to that specified by path.
- * Path can be relative to the current directory, or absolute.
+ * Runs the command of "bg args", where args starts with the job options, if any: it is started
+ * and added to bg_list, or appended to the run queue while every job slot is taken or earlier
+ * commands are still waiting for one. *pid is set to the pid of the started job, or to 0 if it
+ * was queued or could not be started.
+ * Returns the exit status of the bg command: 0 if it was started or queued, 2 for invalid
+ * options and 127 if the launch failed.
  */
-void change_directory(char *path, char **args) {
-    char *new_path;    
-    if (args[2] != NULL){
-	printf("ssi: cd: error, too many arguments\n");
-	return; 
+int submit_bg_process(bg_process_list *bg_list, const char *path, char **args, pid_t *pid) {
+    *pid = 0;
+    job_limits limits;
+    int options = parse_job_options(args, &limits);
+    if (options == -1) return 2;
+    args += options;
+    if (args[0] == NULL) {
+	fprintf(stderr, "ssi: bg: error, no command specified\n");
+	return 2;
     }
-    else if (args[1] == NULL) new_path = "~"; //copying behaviour of typical shell, where the commands "cd ~" and "cd" are equivalent
-    else new_path = args[1];
-    
-    if (!strcmp(new_path, "..")) {
-	for (int i = strlen(path) - 2; i >= 0; --i) {
-	    if (i == 0) {
-		path[1] = '\0';
-		break;
-	    }
-	    else if (path[i] == '/') {
-		path[i] = '\0';
-		break;
-	    }
-	}
-    }	
-    else if (!strcmp(new_path, "~")) {
-	strcpy(path, getenv("HOME"));
+
+    const job_limits *applied = (options > 0) ? &limits : NULL;
+    if ((bg_list -> queued > 0) ||
+	((bg_list -> max_running > 0) && (bg_list -> count >= bg_list -> max_running))) {
+	queue_bg_process(bg_list, path, args, applied);
+	printf("bg: queued, %d waiting\n", bg_list -> queued);
+	return 0;
     }
-    else {
-        if (path[strlen(path)-1] == '/') path[strlen(path) - 1] = '\0';
-	strcpy(path, new_path);
+
+    //the job is tracked by the pid of its last stage, the other stages are reaped silently
+    bg_process *job = init_bg_process(0, path, args, applied);
+    if (launch_bg_process(job) <= 0) {
+	del_bg_process(job);
+	return 127;
     }
-    
-    if (chdir(path) == -1) fprintf(stderr, "ssi: cd: %s: error changing into specified directory\n", path);
-    
-    getcwd(path, PATH_MAX); //modify path input variable to reflect new working directory
+    link_bg_process(bg_list, job);
+    *pid = job -> pid;
+    return 0;
 }
 
 /*
- * check_bg_process_list
+ * store_ring_buffer
  *
- * Traverses the bg_list linked list, checking if any background processes have terminated.
- * If a terminated process is found, the user is notified and bg_list is updated.
+ * Reads from fd into ring until fd has nothing more to give. Once ring is full the oldest bytes
+ * are overwritten, or if overwrite is not set, reading stops. Each read goes straight into the
+ * free part of the buffer, so nothing is copied twice.
+ * Returns 0 at end of file, 1 if ring is full and overwrite is not set, -1 if fd would block.
  */
-void check_bg_process_list(bg_process_list *bg_list){
-    int delete_flag = 0;
-    bg_process *delete_temp;
+int store_ring_buffer(ring_buffer *ring, const int fd, const int overwrite) {
+    for (;;) {
+	size_t start = ring -> written % RING_SIZE;
+	size_t space = RING_SIZE - start;
+	if (!overwrite) {
+	    if (ring -> len == RING_SIZE) return 1;
+	    if (space > RING_SIZE - ring -> len) space = RING_SIZE - ring -> len;
+	}
 
-    pid_t pid = waitpid(0, NULL, WNOHANG);
-    while((pid != 0) && (bg_list -> head != NULL)){
-	if (pid == -1) {
-	    printf("error with waitpid, error: %s\n", strerror(errno));
-	    break;
+	ssize_t n = read(fd, ring -> data + start, space);
+	if (n == 0) return 0;
+	if (n < 0) {
+	    if (errno == EINTR) continue;
+	    return (errno == EAGAIN) ? -1 : 0;
 	}
-	else {
-	    bg_process *temp = bg_list -> head;
-	    while (temp -> pid != pid) {
-		temp = temp -> next;
-		if (temp == NULL) break;
-	    }
 
-	    if (temp != NULL) {
-		print_bg_process(temp); 
-		printf("has terminated.\n");
-	    
-		remove_bg_process(bg_list, temp);
-		del_bg_process(temp);
-	    }
+	ring -> total += n;
+	ring -> written += n;
+	ring -> len += n;
+	if (ring -> len > RING_SIZE) {
+	    ring -> dropped += ring -> len - RING_SIZE;
+	    ring -> len = RING_SIZE;
 	}
-	pid = waitpid(0, NULL, WNOHANG);			 
     }
 }
 
 /*
- * print_bg_list
+ * write_ring_buffer
  *
- * Prints all background process in bg_list in the format specified in the assignment description.
+ * Writes the bytes held in ring to fd, oldest first. Returns 0 on success, -1 on error.
  */
-void print_bg_list(const bg_process_list *bg_list){
-    int i = 0;
-    for (bg_process *temp = bg_list -> head; temp != NULL; temp = temp -> next){
-	print_bg_process(temp); printf("\n");
-	i++;
+int write_ring_buffer(const ring_buffer *ring, const int fd) {
+    size_t start = (ring -> written - ring -> len) % RING_SIZE;
+    size_t first = (start + ring -> len <= RING_SIZE) ? ring -> len : RING_SIZE - start;
+    struct iovec parts[2] = {
+	{ .iov_base = ring -> data + start, .iov_len = first },
+	{ .iov_base = ring -> data, .iov_len = ring -> len - first }
+    };
+
+    size_t left = ring -> len;
+    int part = 0;
+    while (left > 0) {
+	ssize_t n = writev(fd, parts + part, 2 - part);
+	if (n < 0) {
+	    if (errno == EINTR) continue;
+	    return -1;
+	}
+	left -= n;
+	while ((part < 2) && ((size_t)n >= parts[part].iov_len)) n -= parts[part++].iov_len;
+	if (part < 2) {
+	    parts[part].iov_base = (char*)parts[part].iov_base + n;
+	    parts[part].iov_len -= n;
+	}
     }
-    printf("Total Background jobs: %d\n", i);	
+    return 0;
 }
 
 /*
- * kill_process
+ * stop_spilling
  *
- * Attempts to terminate child processes whos pid are specified in input args.
- * Like the typical kill shell command, nothing is output to the user on success.
+ * Reports an error writing the spill file of job and goes back to overwriting the ring buffers.
  */
-void kill_process(bg_process_list *bg_list, char **args) {
-    for (int i = 1; args[i] != NULL; ++i) {	
-	pid_t pid = atoi(args[i]);
-    
-	bg_process *temp = bg_list -> head;
-	while ((temp != NULL) && (temp -> pid != pid)) {
-	    temp = temp -> next;
+void stop_spilling(bg_process *job) {
+    fprintf(stderr, "ssi: bg: %s: %s\n", job -> limits.spill, strerror(errno));
+    close(job -> spill_fd);
+    job -> spill_fd = -1;
+    job -> captured[0].spilling = 0;
+    job -> captured[1].spilling = 0;
+}
+
+/*
+ * capture_bg_output
+ *
+ * Moves what is available on a captured output stream of job (0 for stdout, 1 for stderr) into its
+ * ring buffer. With a spill file, the first time the buffer overflows its contents are written to
+ * the file and from then on the pipe is spliced to the file directly, without passing through
+ * user space. At end of file the pipe is closed.
+ * Returns the number of bytes captured.
+ */
+size_t capture_bg_output(bg_process *job, const int stream) {
+    ring_buffer *ring = &job -> captured[stream];
+    size_t before = ring -> total;
+    int eof = 0;
+
+    while (job -> output[stream] != -1) {
+	if (!ring -> spilling) {
+	    int result = store_ring_buffer(ring, job -> output[stream], job -> spill_fd == -1);
+	    if (result == -1) break;
+	    if (result == 0) {
+		eof = 1;
+		break;
+	    }
+	    //full: the buffered output goes to the spill file first, everything after it is spliced
+	    if (write_ring_buffer(ring, job -> spill_fd) == -1) {
+		stop_spilling(job);
+		continue;
+	    }
+	    ring -> spilled += ring -> len;
+	    ring -> len = 0;
+	    ring -> spilling = 1;
+	    continue;
 	}
-    
-	if (temp != NULL) {
-	    if (kill(pid, SIGINT) == -1) printf("ssi: kill_process: error killing pid %d\n", pid);
-	    remove_bg_process(bg_list, temp);
-	    del_bg_process(temp);
+
+	ssize_t n = splice(job -> output[stream], NULL, job -> spill_fd, NULL, 1 << 16, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n > 0) {
+	    ring -> total += n;
+	    ring -> spilled += n;
 	}
-    }    
+	else if (n == 0) {
+	    eof = 1;
+	    break;
+	}
+	else if (errno == EAGAIN) break;
+	else if (errno != EINTR) stop_spilling(job);
+    }
+
+    if (eof) {
+	close(job -> output[stream]);
+	job -> output[stream] = -1;
+    }
+    return ring -> total - before;
 }
 
 /*
- * execute
+ * print_bg_process
  *
- * Handles the ssi command specified in the input string.
- * Prior to executing the command, execute loops over background processes, checking
- * if any have terminated and notifying the user if any processes have and updating
- * the bg_list input parameter.
- * Special commands include exit, which terminates the program,
+ * Prints a bg_process in the format specified in assignment description.
+ */
+void print_bg_process(const bg_process *process) {
+    printf("%d: ", process -> pid);
+    printf("%s/", process -> path);
+    for (int i = 0; process -> args[i] != NULL; ++i) printf("%s ", process -> args[i]);
+}
+
+/*
+ * elapsed_seconds
+ *
+ * Returns the seconds passed on CLOCK_MONOTONIC since the time since.
+ */
+double elapsed_seconds(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since -> tv_sec) + (now.tv_nsec - since -> tv_nsec) / 1e9;
+}
+
+/*
+ * read_proc_usage
+ *
+ * Reads the CPU time (user plus system, in seconds) and peak resident set size (in KB) of a
+ * running process from /proc, as rusage is only available once the process has been reaped.
+ * Returns 0 on success, -1 if the process could not be read.
+ */
+int read_proc_usage(const pid_t pid, double *cpu, long *maxrss) {
+    char name[64], buf[1024];
+    unsigned long utime, stime;
+
+    snprintf(name, sizeof(name), "/proc/%d/stat", pid);
+    FILE *f = fopen(name, "re");
+    if (f == NULL) return -1;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    //the command name in parentheses may contain spaces, fields are counted from the last ')'
+    char *c = strrchr(buf, ')');
+    if ((c == NULL) || (sscanf(c + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2))
+	return -1;
+    *cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+
+    *maxrss = 0;
+    snprintf(name, sizeof(name), "/proc/%d/status", pid);
+    f = fopen(name, "re");
+    if (f == NULL) return -1;
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+	if (sscanf(buf, "VmHWM: %ld", maxrss) == 1) break;
+    }
+    fclose(f);
+    return 0;
+}
+
+/*
+ * print_bg_usage
+ *
+ * Prints when a running background process was started and the resources it has used so far.
+ */
+void print_bg_usage(const bg_process *process) {
+    char started[16];
+    strftime(started, sizeof(started), "%H:%M:%S", localtime(&process -> launched));
+    printf("(started %s, wall %.2fs", started, elapsed_seconds(&process -> started));
+
+    double cpu;
+    long maxrss;
+    if (read_proc_usage(process -> pid, &cpu, &maxrss) == 0) printf(", cpu %.2fs, max rss %ld KB", cpu, maxrss);
+    printf(")");
+}
+
+/*
+ * write_json_string
+ *
+ * Writes str to out as a quoted JSON string.
+ */
+void write_json_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for (; *str != '\0'; ++str) {
+	unsigned char c = *str;
+	if ((c == '"') || (c == '\\')) fprintf(out, "\\%c", c);
+	else if (c < 0x20) fprintf(out, "\\u%04x", c);
+	else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+/*
+ * write_job_json
+ *
+ * Writes the pid, directory, args and start time of a background process to out, as the first
+ * members of a JSON object.
+ */
+void write_job_json(FILE *out, const bg_process *process) {
+    fprintf(out, "\"pid\":%d,\"dir\":", process -> pid);
+    write_json_string(out, process -> path);
+    fprintf(out, ",\"args\":[");
+    for (int i = 0; process -> args[i] != NULL; ++i) {
+	if (i > 0) fputc(',', out);
+	write_json_string(out, process -> args[i]);
+    }
+    fprintf(out, "],\"start\":%ld", (long)process -> launched);
+}
+
+/*
+ * log_bg_process
+ *
+ * Appends one JSON object describing a terminated background process to job_log, if it is open.
+ */
+void log_bg_process(const bg_process *process, const int status, const struct rusage *usage, const double wall) {
+    if (job_log == NULL) return;
+
+    fputc('{', job_log);
+    write_job_json(job_log, process);
+    fprintf(job_log, ",\"wall\":%.3f,\"user\":%.3f,\"sys\":%.3f,\"maxrss_kb\":%ld,\"exit\":%d}\n", wall,
+	    usage -> ru_utime.tv_sec + usage -> ru_utime.tv_usec / 1e6,
+	    usage -> ru_stime.tv_sec + usage -> ru_stime.tv_usec / 1e6,
+	    usage -> ru_maxrss, exit_status(status));
+    fflush(job_log);
+}
+
+/*
+ * job_state
+ *
+ * Returns the state of a background process as shown by bglist: "running", "stopped",
+ * "terminating" (sent SIGTERM by kill) or "killed" (sent SIGKILL after that timed out).
+ */
+const char* job_state(const bg_process *process) {
+    if (process -> kill_signal != 0) return (process -> kill_signal == SIGKILL) ? "killed" : "terminating";
+    return process -> stopped ? "stopped" : "running";
+}
+
+/*
+ * send_job_event
+ *
+ * Sends every control client a JSON line reporting event for the background process. For
+ * "exited", usage is the rusage wait4 returned with status, and the resources used are
+ * included as in the job log; otherwise usage is NULL.
+ */
+void send_job_event(const char *event, const bg_process *process, const int status, const struct rusage *usage,
+		    const double wall) {
+    if (control.num_clients == 0) return;
+
+    char *line;
+    size_t len;
+    FILE *out = open_memstream(&line, &len);
+    if (out == NULL) return;
+    fprintf(out, "{\"event\":\"%s\",", event);
+    write_job_json(out, process);
+    fprintf(out, ",\"pgid\":%d,\"state\":\"%s\"", process -> pgid, (usage != NULL) ? "exited" : job_state(process));
+    if (usage != NULL) {
+	fprintf(out, ",\"wall\":%.3f,\"user\":%.3f,\"sys\":%.3f,\"maxrss_kb\":%ld,\"exit\":%d", wall,
+		usage -> ru_utime.tv_sec + usage -> ru_utime.tv_usec / 1e6,
+		usage -> ru_stime.tv_sec + usage -> ru_stime.tv_usec / 1e6,
+		usage -> ru_maxrss, exit_status(status));
+    }
+    fprintf(out, "}\n");
+    fclose(out);
+
+    for (int i = control.num_clients - 1; i >= 0; --i) send_control(control.clients[i].fd, line, len);
+    free(line);
+}
+
+/*
+ * set_bg_stopped
+ *
+ * Records whether a background process is stopped, and sends the control clients a "stopped" or
+ * "continued" event if that has changed.
+ */
+void set_bg_stopped(bg_process *process, const int stopped) {
+    if (process -> stopped == stopped) return;
+    process -> stopped = stopped;
+    send_job_event(stopped ? "stopped" : "continued", process, 0, NULL, 0);
+}
+
+/*
+ * print_path
+ *
+ * Prints the ssi prompt in the format specified in assignment description.
+ */
+void print_path(const char *user, const char *host, const char *path) {
+    printf("%s@%s: %s > ", user, host, path);
+}
+
+/*
+ * init_event_loop
+ *
+ * Sets up the epoll instance of the interactive shell. SIGCHLD and SIGINT are blocked and read
+ * from a signalfd instead, so a terminated child or a ^C at the prompt is just another event,
+ * next to input on stdin and the captured output of background jobs.
+ * On a terminal the shell also takes on job control: it waits until it is in the foreground,
+ * moves into a process group of its own, takes the terminal and ignores the signals that would
+ * stop it (^Z, and reading or handing over the terminal from the background).
+ */
+void init_event_loop() {
+    if (isatty(STDIN_FILENO)) {
+	pid_t shell_group;
+	while (tcgetpgrp(STDIN_FILENO) != (shell_group = getpgrp())) kill(-shell_group, SIGTTIN);
+
+	signal(SIGTSTP, SIG_IGN);
+	signal(SIGTTIN, SIG_IGN);
+	signal(SIGTTOU, SIG_IGN);
+	setpgid(0, 0); //fails harmlessly for a session leader, which already leads its group
+	tcsetpgrp(STDIN_FILENO, getpgrp());
+	tcgetattr(STDIN_FILENO, &shell_modes);
+	shell_terminal = STDIN_FILENO;
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+	fprintf(stderr, "ssi: init_event_loop: error blocking signals: %s\n", strerror(errno));
+	exit(1);
+    }
+
+    signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    event_fd = epoll_create1(EPOLL_CLOEXEC);
+    if ((signal_fd == -1) || (event_fd == -1)) {
+	fprintf(stderr, "ssi: init_event_loop: error creating event loop: %s\n", strerror(errno));
+	exit(1);
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EVENT_SIGNAL };
+    epoll_ctl(event_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+
+    ev.data.u64 = EVENT_STDIN;
+    stdin_polled = (epoll_ctl(event_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) == 0); //EPERM for a regular file
+}
+
+/*
+ * reclaim_terminal
+ *
+ * Makes the shell the foreground process group of the terminal again, with its own terminal modes,
+ * after a foreground job has terminated or stopped.
+ */
+void reclaim_terminal() {
+    if (shell_terminal == -1) return;
+    tcsetpgrp(shell_terminal, getpgrp());
+    tcsetattr(shell_terminal, TCSADRAIN, &shell_modes);
+}
+
+/*
+ * drain_sigint
+ *
+ * Discards a pending SIGINT. A ^C typed while a foreground command runs is delivered to the
+ * command; the copy queued for the shell must not reprint the prompt afterwards.
+ */
+void drain_sigint() {
+    if (signal_fd == -1) return;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    struct timespec zero = { 0, 0 };
+    while (sigtimedwait(&mask, NULL, &zero) > 0);
+}
+
+/*
+ * open_control_socket
+ *
+ * Handles --control: listens on a Unix socket at path, whose connections the event loop accepts.
+ * A socket left behind by a shell that is no longer running is replaced. The socket is only
+ * accessible to the user, since its clients can start commands.
+ */
+void open_control_socket(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "ssi: %s: %s\n", path, strerror(ENAMETOOLONG));
+	exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    control.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    mode_t mask = umask(0077);
+    int bound = bind(control.fd, (struct sockaddr *)&addr, sizeof(addr));
+    if ((bound == -1) && (errno == EADDRINUSE)) {
+	//still in use only if something accepts connections on it
+	int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if ((connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == -1) && (errno == ECONNREFUSED)) {
+	    unlink(path);
+	    bound = bind(control.fd, (struct sockaddr *)&addr, sizeof(addr));
+	}
+	else errno = EADDRINUSE;
+	close(probe);
+    }
+    umask(mask);
+    if ((control.fd == -1) || (bound == -1) || (listen(control.fd, CONTROL_MAX_CLIENTS) == -1)) {
+	fprintf(stderr, "ssi: %s: %s\n", path, strerror(errno));
+	exit(1);
+    }
+    control.path = path;
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EVENT_CONTROL };
+    epoll_ctl(event_fd, EPOLL_CTL_ADD, control.fd, &ev);
+}
+
+/*
+ * close_control_socket
+ *
+ * Disconnects every control client and removes the control socket, if there is one.
+ */
+void close_control_socket() {
+    if (control.fd == -1) return;
+    while (control.num_clients > 0) drop_control_client(0);
+    close(control.fd);
+    unlink(control.path);
+    control.fd = -1;
+}
+
+/*
+ * accept_control_clients
+ *
+ * Accepts the pending connections to the control socket. Beyond CONTROL_MAX_CLIENTS they are
+ * closed straight away.
+ */
+void accept_control_clients() {
+    int fd;
+    while ((fd = accept4(control.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+	if (control.num_clients == CONTROL_MAX_CLIENTS) {
+	    close(fd);
+	    continue;
+	}
+	control_client *client = &control.clients[control.num_clients++];
+	client -> fd = fd;
+	client -> buffered = 0;
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = EVENT_CLIENT | fd };
+	epoll_ctl(event_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+/*
+ * find_control_client
+ *
+ * Returns the index of the control client connected on fd, or -1 if it has been dropped.
+ */
+int find_control_client(const int fd) {
+    for (int i = 0; i < control.num_clients; ++i) {
+	if (control.clients[i].fd == fd) return i;
+    }
+    return -1;
+}
+
+/*
+ * drop_control_client
+ *
+ * Disconnects control client i. The last client takes its place.
+ */
+void drop_control_client(const int i) {
+    close(control.clients[i].fd); //also removes it from epoll
+    if (i != --control.num_clients) control.clients[i] = control.clients[control.num_clients];
+}
+
+/*
+ * send_control
+ *
+ * Sends one line to the control client on fd without blocking. A client that has stopped reading,
+ * so that the line does not fit in its socket buffer, is disconnected rather than sent part of
+ * the line. Returns 0 if the line was sent, -1 otherwise.
+ */
+int send_control(const int fd, const char *line, const size_t len) {
+    int i = find_control_client(fd);
+    if (i == -1) return -1;
+    if (send(fd, line, len, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)len) {
+	drop_control_client(i);
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * read_json_string
+ *
+ * Reads the JSON string starting at the quote c into out (which may be NULL to skip it), given its
+ * size. \u escapes are only accepted for ASCII characters. Returns the character after the
+ * closing quote, or NULL if the string is malformed or does not fit.
+ */
+const char* read_json_string(const char *c, char *out, const size_t size) {
+    size_t len = 0;
+    for (++c; *c != '"'; ++c) {
+	if (*c == '\0') return NULL;
+	int ch = *c;
+	if (ch == '\\') {
+	    switch (*++c) {
+	    case 'b': ch = '\b'; break;
+	    case 'f': ch = '\f'; break;
+	    case 'n': ch = '\n'; break;
+	    case 'r': ch = '\r'; break;
+	    case 't': ch = '\t'; break;
+	    case 'u':
+		ch = 0;
+		for (int k = 0; k < 4; ++k) {
+		    if (!isxdigit((unsigned char)*++c)) return NULL;
+		    ch = ch * 16 + (isdigit((unsigned char)*c) ? *c - '0' : tolower((unsigned char)*c) - 'a' + 10);
+		}
+		if ((ch == 0) || (ch > 0x7f)) return NULL;
+		break;
+	    case '\0': return NULL;
+	    default: ch = *c; //\" \\ and \/
+	    }
+	}
+	if (out != NULL) {
+	    if (len + 1 >= size) return NULL;
+	    out[len++] = ch;
+	}
+    }
+    if (out != NULL) out[len] = '\0';
+    return c + 1;
+}
+
+/*
+ * json_field
+ *
+ * Finds the member key of the JSON object in line and copies its value to value, given its size:
+ * the text of a string, or as written for a number or literal. Members whose values are objects
+ * or arrays are not supported, which is enough for control requests.
+ * Returns 1 for a string, 0 for another value, and -1 if key is missing or cannot be read.
+ */
+int json_field(const char *line, const char *key, char *value, const size_t size) {
+    const char *c = line;
+    while (isspace((unsigned char)*c)) ++c;
+    if (*c++ != '{') return -1;
+
+    for (;;) {
+	while (isspace((unsigned char)*c) || (*c == ',')) ++c;
+	if (*c != '"') return -1; //the end of the object
+	char name[64];
+	if ((c = read_json_string(c, name, sizeof(name))) == NULL) return -1;
+	while (isspace((unsigned char)*c)) ++c;
+	if (*c++ != ':') return -1;
+	while (isspace((unsigned char)*c)) ++c;
+
+	int match = !strcmp(name, key);
+	if (*c == '"') {
+	    if ((c = read_json_string(c, match ? value : NULL, size)) == NULL) return -1;
+	    if (match) return 1;
+	    continue;
+	}
+	size_t len = strcspn(c, ",} \t\r\n");
+	if ((len == 0) || (*c == '{') || (*c == '[') || (match && (len >= size))) return -1;
+	if (match) {
+	    memcpy(value, c, len);
+	    value[len] = '\0';
+	    return 0;
+	}
+	c += len;
+    }
+}
+
+/*
+ * handle_control_request
+ *
+ * Carries out one request line from the control client on fd and sends it the reply, a JSON
+ * object with the "reply" op, the request's "id" if it had one, and "ok". The requests are:
+ * {"op":"submit","command":"..."}, which runs command as "bg command" would, replying with the
+ * pid of the job or whether it was queued;
+ * {"op":"kill","pid":N}, which kills background process N as the kill builtin does; and
+ * {"op":"status"}, which replies with every background process and its state.
+ * $? is not changed by a request. Returns 1 if the shell printed something, in which case the
+ * prompt is printed again.
+ */
+int handle_control_request(const int fd, const char *line, char *path, bg_process_list *bg_list) {
+    char *reply;
+    size_t len;
+    FILE *out = open_memstream(&reply, &len);
+    if (out == NULL) return 0;
+
+    char op[16], value[ARG_MAX];
+    if (json_field(line, "op", op, sizeof(op)) != 1) op[0] = '\0';
+    fprintf(out, "{\"reply\":");
+    write_json_string(out, op);
+    int id = json_field(line, "id", value, sizeof(value));
+    char *end;
+    if (id == 1) {
+	fprintf(out, ",\"id\":");
+	write_json_string(out, value);
+    }
+    else if ((id == 0) && (strtod(value, &end), *end == '\0')) fprintf(out, ",\"id\":%s", value);
+
+    const char *error = NULL;
+    int printed = 0;
+    if (!strcmp(op, "submit")) {
+	char command[ARG_MAX];
+	if ((json_field(line, "command", value, sizeof(value)) != 1) ||
+	    (snprintf(command, sizeof(command), "bg %s", value) >= (int)sizeof(command))) error = "missing or invalid command";
+	else {
+	    arena mem;
+	    init_arena(&mem, ARENA_SIZE);
+	    char **args = parse_input(command, &mem);
+	    if ((args[1] == NULL) || !strcmp(args[1], "-j")) error = "no command specified";
+	    else {
+		pid_t pid;
+		int status = submit_bg_process(bg_list, path, args + 1, &pid);
+		if (pid > 0) fprintf(out, ",\"ok\":true,\"pid\":%d", pid);
+		else if (status == 0) fprintf(out, ",\"ok\":true,\"queued\":%d", bg_list -> queued);
+		else error = "launch failed";
+		printed = (pid == 0); //bg prints when it queues a command or fails
+	    }
+	    reset_arena(&mem);
+	    free(mem.base);
+	}
+    }
+    else if (!strcmp(op, "kill")) {
+	bg_process *job = NULL;
+	if ((json_field(line, "pid", value, sizeof(value)) == 0) && (strtol(value, &end, 10) > 0) && (*end == '\0'))
+	    job = find_bg_process(bg_list, atoi(value));
+	if (job == NULL) error = "no such job";
+	else {
+	    char *args[] = { "kill", value, NULL };
+	    kill_process(bg_list, args);
+	    fprintf(out, ",\"ok\":true,\"pid\":%d,\"state\":\"%s\"", job -> pid, job_state(job));
+	}
+    }
+    else if (!strcmp(op, "status")) {
+	fprintf(out, ",\"ok\":true,\"jobs\":[");
+	for (bg_process *temp = bg_list -> head; temp != NULL; temp = temp -> next) {
+	    fprintf(out, (temp == bg_list -> head) ? "{" : ",{");
+	    write_job_json(out, temp);
+	    fprintf(out, ",\"pgid\":%d,\"state\":\"%s\"}", temp -> pgid, job_state(temp));
+	}
+	fprintf(out, "],\"queued\":%d", bg_list -> queued);
+    }
+    else error = "unknown op";
+
+    if (error != NULL) fprintf(out, ",\"ok\":false,\"error\":\"%s\"", error);
+    fprintf(out, "}\n");
+    fclose(out);
+    send_control(fd, reply, len);
+    free(reply);
+    return printed;
+}
+
+/*
+ * read_control_client
+ *
+ * Reads what the control client on fd has sent and handles each complete request line. A client
+ * that disconnects, or sends a line longer than ARG_MAX, is dropped.
+ * Returns 1 if a request printed something, so the prompt has to be printed again.
+ */
+int read_control_client(const int fd, char *path, bg_process_list *bg_list) {
+    int i = find_control_client(fd);
+    if (i == -1) return 0;
+    control_client *client = &control.clients[i];
+
+    ssize_t n = read(fd, client -> buffer + client -> buffered, sizeof(client -> buffer) - client -> buffered);
+    if ((n == -1) && ((errno == EAGAIN) || (errno == EINTR))) return 0;
+    if (n <= 0) {
+	drop_control_client(i);
+	return 0;
+    }
+    client -> buffered += n;
+
+    int printed = 0;
+    char *newline;
+    while ((newline = memchr(client -> buffer, '\n', client -> buffered)) != NULL) {
+	char line[ARG_MAX];
+	int len = newline - client -> buffer;
+	memcpy(line, client -> buffer, len);
+	line[len] = '\0';
+	client -> buffered -= len + 1;
+	memmove(client -> buffer, newline + 1, client -> buffered);
+
+	printed |= handle_control_request(fd, line, path, bg_list);
+	if ((i = find_control_client(fd)) == -1) return printed; //dropped while it was sent the reply
+	client = &control.clients[i];
+    }
+    if (client -> buffered == sizeof(client -> buffer)) {
+	const char *reply = "{\"reply\":\"\",\"ok\":false,\"error\":\"request too long\"}\n";
+	send_control(fd, reply, strlen(reply));
+	if ((i = find_control_client(fd)) != -1) drop_control_client(i);
+    }
+    return printed;
+}
+
+/*
+ * get_input
+ *
+ * Retrieves user input from ssi prompt.
+ * While waiting for a line, the event loop waits on stdin, the signalfd and the captured output
+ * of background jobs together, so terminated background processes are reaped and reported, and
+ * their output shown, as soon as it happens; the prompt is reprinted afterwards. ^C abandons the
+ * line being typed and prints a new prompt. While a killed job has yet to exit, the wait is cut
+ * short at its deadline so it can be sent SIGKILL. With --control, connections to the control
+ * socket and requests from its clients are handled here too, so they are served while the shell
+ * is at its prompt.
+ * stdin is read with read() into a private buffer rather than fgets so that epoll sees
+ * exactly the input that has not been consumed yet.
+ * Returns -1 at end of input.
+ */
+int get_input(char *input, const int inputsize, bg_process_list *bg_list,
+	      const char *user, const char *host, char *path) {
+    static char buffer[ARG_MAX];
+    static int buffered = 0;
+    static int eof = 0;
+
+    for (;;) {
+	char *newline = memchr(buffer, '\n', buffered);
+	if ((newline != NULL) || (buffered == sizeof(buffer)) || (eof && (buffered > 0))) {
+	    int len = (newline != NULL) ? newline - buffer : buffered;
+	    int copy = (len < inputsize - 1) ? len : inputsize - 1;
+	    memcpy(input, buffer, copy);
+	    input[copy] = '\0';
+
+	    if (newline != NULL) ++len;
+	    buffered -= len;
+	    memmove(buffer, buffer + len, buffered);
+	    return 0;
+	}
+	if (eof) return -1;
+
+	fflush(stdout);
+
+	struct epoll_event events[16];
+	int n = epoll_wait(event_fd, events, 16, stdin_polled ? next_kill_timeout(bg_list) : 0);
+	if (n == -1) {
+	    if (errno == EINTR) continue;
+	    fprintf(stderr, "ssi: get_input: error waiting for events: %s\n", strerror(errno));
+	    return -1;
+	}
+	escalate_kills(bg_list);
+
+	int stdin_ready = !stdin_polled;
+	int notices = 0; //lines printed below the prompt, which is then printed again
+	for (int i = 0; i < n; ++i) {
+	    uint64_t source = events[i].data.u64;
+	    if (source == EVENT_STDIN) {
+		stdin_ready = 1;
+	    }
+	    else if (source == EVENT_CONTROL) {
+		accept_control_clients();
+	    }
+	    else if (source & EVENT_CLIENT) {
+		notices += read_control_client(source & ~EVENT_CLIENT, path, bg_list);
+	    }
+	    else if (source == EVENT_SIGNAL) {
+		struct signalfd_siginfo info;
+		int interrupted = 0;
+		while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+		    if (info.ssi_signo == SIGINT) interrupted = 1;
+		}
+		if (interrupted) {
+		    printf("\n");
+		    ++notices;
+		}
+		//SIGCHLD is not queued per child, so every terminated child is reaped at once
+		notices += check_bg_process_list(bg_list, notices == 0);
+	    }
+	    else {
+		//a grandchild can hold the pipes after the job was reaped, they are read until it exits
+		bg_process *job = find_captured_bg_process(bg_list, source >> 1);
+		if (job != NULL) capture_bg_output(job, source & 1);
+	    }
+	}
+	if (notices > 0) print_path(user, host, path);
+
+	if (stdin_ready) {
+	    ssize_t n = read(STDIN_FILENO, buffer + buffered, sizeof(buffer) - buffered);
+	    if (n == 0) eof = 1;
+	    else if (n > 0) buffered += n;
+	    else if (errno != EINTR && errno != EAGAIN) eof = 1;
+	}
+    }
+}
+
+/*
+ * parse_input
+ *
+ * convert an arg string into an array of args that is formed using the space delimeter.
+ * The pipe and redirection operators |, <, > and >> are always separate args, even when
+ * they are not surrounded by spaces. Spaces and operators inside single or double quotes or
+ * after a backslash are part of the word; the quotes are removed by expand_args.
+ * args_string is tokenised in place: words point into it and are terminated by overwriting the
+ * following space or operator, operators point at string constants. Only the argv array is
+ * allocated, from mem, so the args are valid until mem is reset and must not be modified.
+ * Variables and globs are then expanded by expand_args, whose results also come from mem.
+ */
+char** parse_input(char *args_string, arena *mem) {
+    char **args = arena_alloc(mem, sizeof(char*) * (strlen(args_string) + 1));
+
+    int i = 0;
+    char *c = args_string;
+    while (*c != '\0') {
+	if ((*c == ' ') || (*c == '\t')) {
+	    *c++ = '\0'; //terminates the word before it, if any
+	    continue;
+	}
+
+	if ((*c == '|') || (*c == '<') || (*c == '>')) {
+	    size_t len = ((c[0] == '>') && (c[1] == '>')) ? 2 : 1;
+	    args[i++] = (len == 2) ? ">>" : (*c == '|') ? "|" : (*c == '<') ? "<" : ">";
+	    *c = '\0';
+	    c += len;
+	}
+	else {
+	    args[i++] = c;
+	    c = end_of_word(c);
+	}
+    }
+    args[i] = NULL;
+    
+    return expand_args(args, mem);
+}
+
+/*
+ * end_of_word
+ *
+ * Returns the end of the word starting at c: the first space, tab or operator character that is
+ * not quoted, or the end of the line. A quote left open runs to the end of the line.
+ */
+char* end_of_word(char *c) {
+    char quote = '\0';
+    for (; *c != '\0'; ++c) {
+	if (quote == '\0') {
+	    if (strchr(" \t|<>", *c) != NULL) break;
+	    if ((*c == '\'') || (*c == '"')) quote = *c;
+	    else if ((*c == '\\') && (c[1] != '\0')) ++c;
+	}
+	else if (*c == quote) quote = '\0';
+	else if ((quote == '"') && (*c == '\\') && (c[1] != '\0')) ++c;
+    }
+    return c;
+}
+
+/*
+ * lookup_variable
+ *
+ * If *c starts with $NAME or ${NAME}, returns the value of the environment variable (empty if it
+ * is not set), for $? the exit status of the last command and for $$ the pid of the shell, and
+ * moves *c past the reference. special and name are scratch space of 16 and ARG_MAX bytes for
+ * the value. Returns NULL if *c does not start with a variable.
+ */
+const char* lookup_variable(const char **c, char *special, char *name) {
+    const char *v = *c;
+    const char *value;
+    if ((v[0] == '$') && ((v[1] == '?') || (v[1] == '$'))) {
+	snprintf(special, 16, "%d", (v[1] == '?') ? last_status : (int)getpid());
+	*c += 2;
+	return special;
+    }
+    else if ((v[0] == '$') && (v[1] == '{') && (strchr(v, '}') != NULL)) {
+	size_t k = strchr(v, '}') - (v + 2);
+	memcpy(name, v + 2, k);
+	name[k] = '\0';
+	*c += k + 3;
+    }
+    else if ((v[0] == '$') && ((v[1] == '_') || isalpha((unsigned char)v[1]))) {
+	size_t k = 1;
+	while ((v[k] == '_') || isalnum((unsigned char)v[k])) ++k;
+	memcpy(name, v + 1, k - 1);
+	name[k - 1] = '\0';
+	*c += k;
+    }
+    else return NULL;
+
+    value = getenv(name);
+    return (value == NULL) ? "" : value;
+}
+
+/*
+ * expand_word
+ *
+ * Returns word with its variables expanded and its quotes removed, allocated from mem. Inside
+ * single quotes every character is literal; inside double quotes variables are expanded and a
+ * backslash only escapes $, " and \; outside quotes a backslash escapes any character.
+ * If word has glob characters that are not quoted or escaped, *pattern is set to the same word
+ * as an fnmatch pattern, in which the quoted ones are escaped with a backslash, otherwise to NULL.
+ * The glob characters in the value of a variable outside quotes are expanded, as in sh.
+ */
+char* expand_word(const char *word, arena *mem, char **pattern) {
+    char special[16];
+    char name[ARG_MAX];
+    char *result = NULL;
+    size_t len = 0, pattern_len = 0;
+    int globbed = 0;
+    *pattern = NULL;
+
+    //the first pass measures the result and the pattern, the second writes them
+    for (int pass = 0; pass < 2; ++pass) {
+	size_t n = 0, m = 0;
+	char quote = '\0';
+	for (const char *c = word; *c != '\0'; ) {
+	    const char *value = (quote != '\'') ? lookup_variable(&c, special, name) : NULL;
+	    char literal[2] = { '\0', '\0' };
+	    if (value == NULL) {
+		if ((quote == '\0') && ((*c == '\'') || (*c == '"'))) {
+		    quote = *c++;
+		    continue;
+		}
+		if ((quote != '\0') && (*c == quote)) {
+		    quote = '\0';
+		    ++c;
+		    continue;
+		}
+		if ((quote == '\0') && (*c != '\\')) {
+		    if (pass == 1) result[n] = *c;
+		    if ((pass == 1) && (*pattern != NULL)) (*pattern)[m] = *c;
+		    if (strchr("*?[", *c) != NULL) globbed = 1;
+		    ++n;
+		    ++m;
+		    ++c;
+		    continue;
+		}
+		//an escaped character, or any other inside quotes
+		if ((*c == '\\') && (c[1] != '\0') &&
+		    ((quote == '\0') || ((quote == '"') && (strchr("$\"\\", c[1]) != NULL)))) ++c;
+		literal[0] = *c++;
+		value = literal;
+	    }
+
+	    //the value of a variable outside quotes can be a glob, anything else is matched literally
+	    const int quoted = (quote != '\0') || (value == literal);
+	    for (const char *v = value; *v != '\0'; ++v) {
+		if (pass == 1) result[n] = *v;
+		++n;
+		if ((quoted || (*v == '\\')) && (strchr("*?[\\", *v) != NULL)) {
+		    if ((pass == 1) && (*pattern != NULL)) (*pattern)[m] = '\\';
+		    ++m;
+		}
+		else if (strchr("*?[", *v) != NULL) globbed = 1;
+		if ((pass == 1) && (*pattern != NULL)) (*pattern)[m] = *v;
+		++m;
+	    }
+	}
+	if (pass == 0) {
+	    len = n;
+	    pattern_len = m;
+	    result = arena_alloc(mem, len + 1);
+	    if (globbed) *pattern = arena_alloc(mem, pattern_len + 1);
+	}
+    }
+    result[len] = '\0';
+    if (*pattern != NULL) (*pattern)[pattern_len] = '\0';
+    return result;
+}
+
+/*
+ * has_glob
+ *
+ * Returns 1 if the pattern word contains any of the glob characters *, ? and [ that is not
+ * escaped with a backslash, 0 otherwise.
+ */
+int has_glob(const char *word) {
+    for (const char *c = word; *c != '\0'; ++c) {
+	if ((*c == '\\') && (c[1] != '\0')) ++c;
+	else if (strchr("*?[", *c) != NULL) return 1;
+    }
+    return 0;
+}
+
+/*
+ * drop_cached_listing
+ *
+ * Removes a listing from listing_cache, stopping its inotify watch and freeing its names.
+ */
+void drop_cached_listing(dir_listing *listing) {
+    inotify_rm_watch(listing_cache.inotify_fd, listing -> watch);
+    free(listing -> names);
+    *listing = listing_cache.entries[--listing_cache.count];
+}
+
+/*
+ * check_listing_cache
+ *
+ * Reads the pending inotify events and drops the cached listing of every directory that has
+ * changed. The events are queued by the change itself, so a listing is never used after one.
+ */
+void check_listing_cache() {
+    if (listing_cache.inotify_fd == -1) return;
+
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(listing_cache.inotify_fd, buffer, sizeof(buffer))) > 0) {
+	for (char *c = buffer; c < buffer + n; c += sizeof(struct inotify_event) + ((struct inotify_event*)c) -> len) {
+	    const struct inotify_event *event = (struct inotify_event*)c;
+	    for (int i = 0; i < listing_cache.count; ++i) {
+		if (listing_cache.entries[i].watch != event -> wd) continue;
+		if (event -> mask & IN_IGNORED) listing_cache.entries[i].watch = -1; //already removed by the kernel
+		drop_cached_listing(&listing_cache.entries[i]);
+		break;
+	    }
+	}
+    }
+}
+
+/*
+ * read_dir_listing
+ *
+ * Reads every entry of the open directory fd except . and .. into listing with getdents64,
+ * which returns many entries per system call into one large buffer, without the per-entry
+ * overhead and allocation of readdir. Returns 0 on success, -1 on error.
+ */
+int read_dir_listing(const int fd, dir_listing *listing) {
+    char buffer[1 << 16];
+    size_t capacity = 0;
+    listing -> names = NULL;
+    listing -> len = 0;
+    listing -> count = 0;
+
+    for (;;) {
+	long n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+	if (n == 0) return 0;
+	if (n < 0) {
+	    free(listing -> names);
+	    listing -> names = NULL;
+	    return -1;
+	}
+
+	for (long off = 0; off < n; off += ((linux_dirent64*)(buffer + off)) -> d_reclen) {
+	    const linux_dirent64 *entry = (linux_dirent64*)(buffer + off);
+	    if (!strcmp(entry -> d_name, ".") || !strcmp(entry -> d_name, "..")) continue;
+
+	    size_t k = strlen(entry -> d_name) + 2;
+	    if (listing -> len + k > capacity) {
+		capacity = (capacity == 0) ? sizeof(buffer) : 2 * capacity;
+		listing -> names = realloc(listing -> names, capacity);
+	    }
+	    listing -> names[listing -> len] = entry -> d_type;
+	    memcpy(listing -> names + listing -> len + 1, entry -> d_name, k - 1);
+	    listing -> len += k;
+	    ++listing -> count;
+	}
+    }
+}
+
+/*
+ * list_directory
+ *
+ * Returns the listing of the directory dir, or NULL if it cannot be read. Listings are cached
+ * by device and inode, so the same directory is found whatever path it is reached by; only
+ * directories of at least GLOB_CACHE_MIN entries are cached, and the least recently used one
+ * is dropped when the cache is full. The watch is added before the directory is read, so no
+ * change can fall between the two. A listing that is not cached (its watch is -1) is freed by
+ * the caller.
+ */
+dir_listing* list_directory(const char *dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    if ((fd == -1) || (fstat(fd, &st) == -1)) {
+	if (fd != -1) close(fd);
+	return NULL;
+    }
+
+    check_listing_cache();
+    for (int i = 0; i < listing_cache.count; ++i) {
+	dir_listing *cached = &listing_cache.entries[i];
+	if ((cached -> dev == st.st_dev) && (cached -> ino == st.st_ino)) {
+	    cached -> last_used = ++listing_cache.clock;
+	    close(fd);
+	    return cached;
+	}
+    }
+
+    if (listing_cache.enabled && (listing_cache.inotify_fd == -1)) {
+	listing_cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (listing_cache.inotify_fd == -1) listing_cache.enabled = 0;
+    }
+    int watch = -1;
+    if (listing_cache.enabled) {
+	char proc[64]; //the directory that is open, even if dir has been renamed meanwhile
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	watch = inotify_add_watch(listing_cache.inotify_fd, proc,
+				  IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    }
+
+    dir_listing listing = { .dev = st.st_dev, .ino = st.st_ino, .watch = -1 };
+    int error = read_dir_listing(fd, &listing);
+    close(fd);
+    if ((watch != -1) && ((error == -1) || (listing.count < GLOB_CACHE_MIN))) {
+	inotify_rm_watch(listing_cache.inotify_fd, watch);
+	watch = -1;
+    }
+    if (error == -1) return NULL;
+
+    if (watch == -1) {
+	dir_listing *uncached = malloc(sizeof(dir_listing));
+	*uncached = listing;
+	return uncached;
+    }
+
+    if (listing_cache.count == GLOB_CACHE_MAX) {
+	int oldest = 0;
+	for (int i = 1; i < listing_cache.count; ++i) {
+	    if (listing_cache.entries[i].last_used < listing_cache.entries[oldest].last_used) oldest = i;
+	}
+	drop_cached_listing(&listing_cache.entries[oldest]);
+    }
+    listing.watch = watch;
+    listing.last_used = ++listing_cache.clock;
+    listing_cache.entries[listing_cache.count] = listing;
+    return &listing_cache.entries[listing_cache.count++];
+}
+
+/*
+ * compare_strings
+ *
+ * qsort comparison function for an array of strings, in byte order.
+ */
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/*
+ * expand_glob
+ *
+ * Appends the paths matching pattern to the array matches, which has count entries and room
+ * for capacity, in sorted order. The pattern is matched one path component at a time: a component
+ * without glob characters is taken as it is, without its backslashes, any other is matched with
+ * fnmatch against the listing of each directory reached so far. A leading . must be matched
+ * explicitly. matches, the paths and the lists of paths reached are all allocated from mem, and
+ * matches grows with arena_realloc. Returns the number of paths appended.
+ */
+int expand_glob(const char *pattern, arena *mem, char ***matches, int *count, int *capacity) {
+    //paths reached so far, each ending in / unless it is empty (the current directory)
+    int num_paths = 1;
+    char **paths = arena_alloc(mem, sizeof(char*));
+    paths[0] = (pattern[0] == '/') ? "/" : "";
+    const char *component = pattern + strspn(pattern, "/");
+
+    char piece[PATH_MAX];
+    while (num_paths > 0) {
+	size_t k = strcspn(component, "/");
+	int last = (component[k] == '\0');
+	if (k >= PATH_MAX) {
+	    num_paths = 0;
+	    break;
+	}
+	memcpy(piece, component, k);
+	piece[k] = '\0';
+
+	int num_next = 0, next_capacity = num_paths;
+	char **next = arena_alloc(mem, sizeof(char*) * next_capacity);
+	int literal = !has_glob(piece);
+	if (literal) {
+	    //the escaped glob characters are matched as they are
+	    char *to = piece;
+	    for (const char *from = piece; *from != '\0'; ++from) {
+		if ((*from == '\\') && (from[1] != '\0')) ++from;
+		*to++ = *from;
+	    }
+	    *to = '\0';
+	}
+	for (int p = 0; p < num_paths; ++p) {
+	    size_t prefix = strlen(paths[p]);
+	    if (literal) {
+		char *path = arena_alloc(mem, prefix + strlen(piece) + 2);
+		sprintf(path, last ? "%s%s" : "%s%s/", paths[p], piece);
+		struct stat st;
+		if (last && (lstat(path, &st) == -1)) continue;
+		next[num_next++] = path; //at most one per path, so there is room
+		continue;
+	    }
+
+	    dir_listing *listing = list_directory((prefix > 0) ? paths[p] : ".");
+	    if (listing == NULL) continue;
+	    for (char *entry = listing -> names; entry < listing -> names + listing -> len; entry += strlen(entry + 1) + 2) {
+		const char *name = entry + 1;
+		if (fnmatch(piece, name, FNM_PERIOD) != 0) continue;
+
+		char *path = arena_alloc(mem, prefix + strlen(name) + 2);
+		sprintf(path, "%s%s", paths[p], name);
+		if (!last) {
+		    //only directories can hold the rest of the pattern
+		    struct stat st;
+		    unsigned char type = entry[0];
+		    if ((type != DT_DIR) && (type != DT_LNK) && (type != DT_UNKNOWN)) continue;
+		    if ((type != DT_DIR) && ((stat(path, &st) == -1) || !S_ISDIR(st.st_mode))) continue;
+		    strcat(path, "/");
+		}
+		if (num_next == next_capacity) {
+		    next = arena_realloc(mem, next, sizeof(char*) * next_capacity, sizeof(char*) * 2 * next_capacity);
+		    next_capacity *= 2;
+		}
+		next[num_next++] = path;
+	    }
+	    if (listing -> watch == -1) {
+		free(listing -> names);
+		free(listing);
+	    }
+	}
+
+	paths = next;
+	num_paths = num_next;
+	if (last) break;
+	component += k + 1;
+    }
+
+    if (*count + num_paths > *capacity) {
+	*matches = arena_realloc(mem, *matches, sizeof(char*) * *capacity, sizeof(char*) * (*count + num_paths));
+	*capacity = *count + num_paths;
+    }
+    qsort(paths, num_paths, sizeof(char*), compare_strings);
+    memcpy(*matches + *count, paths, sizeof(char*) * num_paths);
+    *count += num_paths;
+    return num_paths;
+}
+
+/*
+ * expand_args
+ *
+ * Expands the variables and removes the quotes in every word of args, then replaces each word
+ * containing unquoted glob characters by the paths it matches, sorted; a glob matching nothing is
+ * kept as it is, as is one after a redirection that does not match exactly one file. A word that
+ * was only variables and expands to nothing is dropped, "" is an empty arg. Returns the new argv,
+ * allocated from mem like the words and the matches, so expanding a line does not call malloc.
+ */
+char** expand_args(char **args, arena *mem) {
+    int capacity = 0, count = 0;
+    for (capacity = 1; args[capacity - 1] != NULL; ++capacity);
+    char **expanded = arena_alloc(mem, sizeof(char*) * capacity);
+
+    for (int i = 0; args[i] != NULL; ++i) {
+	char *word = args[i];
+	char *pattern = NULL;
+	int operator = !strcmp(word, "|") || !strcmp(word, "<") || !strcmp(word, ">") || !strcmp(word, ">>");
+	if (!operator && (strpbrk(word, "$'\"\\") != NULL)) {
+	    word = expand_word(word, mem, &pattern);
+	    if ((word[0] == '\0') && (strpbrk(args[i], "'\"") == NULL)) continue;
+	}
+	else if (!operator && has_glob(word)) pattern = word;
+
+	if (pattern != NULL) {
+	    int redirected = (i > 0) && (!strcmp(args[i - 1], "<") || !strcmp(args[i - 1], ">") || !strcmp(args[i - 1], ">>"));
+	    int found = expand_glob(pattern, mem, &expanded, &count, &capacity);
+	    if ((found == 1) || ((found > 1) && !redirected)) continue;
+	    count -= found;
+	}
+	if (count + 1 >= capacity) {
+	    expanded = arena_realloc(mem, expanded, sizeof(char*) * capacity, sizeof(char*) * 2 * capacity);
+	    capacity *= 2;
+	}
+	expanded[count++] = word;
+    }
+
+    if (count == capacity) expanded = arena_realloc(mem, expanded, sizeof(char*) * capacity, sizeof(char*) * (capacity + 1));
+    expanded[count] = NULL;
+    return expanded;
+}
+
+/*
+ * normalize_path
+ *
+ * Rewrites the absolute path in place without . components, repeated slashes or a trailing slash,
+ * with each .. removing the component before it, as the logical working directory of a shell is
+ * kept. The file system is not consulted. Returns the new length.
+ */
+int normalize_path(char *path) {
+    int len = 1; //path[0] is the leading slash
+    for (char *c = path + 1; *c != '\0'; ) {
+	size_t k = strcspn(c, "/");
+	if ((k == 0) || ((k == 1) && (c[0] == '.'))) { //nothing to add
+	}
+	else if ((k == 2) && (c[0] == '.') && (c[1] == '.')) {
+	    while ((len > 1) && (path[len - 1] != '/')) --len;
+	    if (len > 1) --len;
+	}
+	else {
+	    if (len > 1) path[len++] = '/';
+	    memmove(path + len, c, k);
+	    len += k;
+	}
+	c += k;
+	if (*c == '/') ++c;
+    }
+    path[len] = '\0';
+    return len;
+}
+
+/*
+ * run_dir_probe
+ *
+ * Body of the helper thread of a dir_probe: opens the directory and hands the descriptor to the
+ * shell, or if the shell has given up on it, closes it and frees the probe.
+ */
+void* run_dir_probe(void *arg) {
+    dir_probe *probe = arg;
+    int fd = open(probe -> path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    int error = errno;
+
+    pthread_mutex_lock(&probe -> lock);
+    probe -> fd = fd;
+    probe -> error = error;
+    probe -> done = 1;
+    int abandoned = probe -> abandoned;
+    pthread_cond_signal(&probe -> finished);
+    pthread_mutex_unlock(&probe -> lock);
+
+    if (abandoned) {
+	if (fd != -1) close(fd);
+	pthread_mutex_destroy(&probe -> lock);
+	pthread_cond_destroy(&probe -> finished);
+	free(probe);
+    }
+    return NULL;
+}
+
+/*
+ * open_directory
+ *
+ * Opens the directory path (with O_PATH, enough for fchdir) on a helper thread and waits at most
+ * PROBE_TIMEOUT seconds for it. The thread blocks every signal, so they are still delivered to
+ * the shell's signalfd. Returns the descriptor, or -1 with error set to the errno of the open,
+ * or to ETIMEDOUT if the file system did not answer in time.
+ */
+int open_directory(const char *path, int *error) {
+    dir_probe *probe = malloc(sizeof(dir_probe));
+    pthread_mutex_init(&probe -> lock, NULL);
+    pthread_cond_init(&probe -> finished, NULL);
+    snprintf(probe -> path, PATH_MAX, "%s", path);
+    probe -> done = 0;
+    probe -> abandoned = 0;
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    int err = pthread_create(&thread, &attr, run_dir_probe, probe);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) { //no thread, open it here
+	free(probe);
+	int fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	*error = errno;
+	return fd;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += PROBE_TIMEOUT;
+    pthread_mutex_lock(&probe -> lock);
+    while (!probe -> done && (pthread_cond_timedwait(&probe -> finished, &probe -> lock, &deadline) != ETIMEDOUT));
+    if (!probe -> done) {
+	probe -> abandoned = 1; //the thread frees it
+	pthread_mutex_unlock(&probe -> lock);
+	*error = ETIMEDOUT;
+	return -1;
+    }
+    pthread_mutex_unlock(&probe -> lock);
+
+    int fd = probe -> fd;
+    *error = probe -> error;
+    pthread_mutex_destroy(&probe -> lock);
+    pthread_cond_destroy(&probe -> finished);
+    free(probe);
+    return fd;
+}
+
+/*
+ * change_directory
+ *
+ * Changes to the directory specified in **args and updates path, the working directory shown in
+ * the prompt, without asking the file system for it again with getcwd.
+ * Special path args accepted are:
+ * cd .. , which changes the directory to the directory one level higher than the current direcotyr
+ * cd ~ or cd (no arguments), which changes the directory to the home directory of the user, as specified by getenv("HOME")
+ * cd path , which changes the directory to that specified by path.
+ * Path can be relative to the current directory, or absolute. Like cd in bash, .. is taken
+ * lexically, so it returns through a symbolic link rather than to the link target's parent.
+ * The directory is opened by open_directory, so a mount that does not respond makes cd fail
+ * after PROBE_TIMEOUT seconds instead of hanging the shell; the shell then changes into the
+ * opened directory with fchdir, which does not look up the path again.
+ */
+void change_directory(char *path, char **args) {
+    char *new_path;    
+    if (args[2] != NULL){
+	printf("ssi: cd: error, too many arguments\n");
+	return; 
+    }
+    else if (args[1] == NULL) new_path = "~"; //copying behaviour of typical shell, where the commands "cd ~" and "cd" are equivalent
+    else new_path = args[1];
+    if (!strcmp(new_path, "~")) new_path = getenv("HOME");
+    if (new_path == NULL) {
+	fprintf(stderr, "ssi: cd: error, HOME is not set\n");
+	return;
+    }
+
+    char target[PATH_MAX];
+    if (snprintf(target, PATH_MAX, (new_path[0] == '/') ? "%s" : "%s/%s",
+		 (new_path[0] == '/') ? new_path : path, new_path) >= PATH_MAX) {
+	fprintf(stderr, "ssi: cd: %s: %s\n", new_path, strerror(ENAMETOOLONG));
+	return;
+    }
+    normalize_path(target);
+
+    int error;
+    int fd = open_directory(target, &error);
+    if (fd == -1) {
+	if (error == ETIMEDOUT) fprintf(stderr, "ssi: cd: %s: not responding after %d seconds\n", new_path, PROBE_TIMEOUT);
+	else fprintf(stderr, "ssi: cd: %s: %s\n", new_path, strerror(error));
+	return;
+    }
+    if (fchdir(fd) == -1) fprintf(stderr, "ssi: cd: %s: %s\n", new_path, strerror(errno));
+    else strcpy(path, target); //modify path input variable to reflect new working directory
+    close(fd);
+}
+
+/*
+ * report_bg_process
+ *
+ * Called once pid has been reaped with the status and rusage returned by wait4. If pid is a
+ * background process the user is notified (on a fresh line if newline_first is set) with its
+ * exit status and resource usage, the job is logged and sent to the control clients, and it is
+ * removed from bg_list.
+ * For a pipeline the usage is that of its last stage.
+ * Returns 1 if pid was a background process, 0 otherwise.
+ */
+int report_bg_process(bg_process_list *bg_list, const pid_t pid, const int status, const struct rusage *usage,
+		      int newline_first) {
+    if (pid == history.compactor) history.compactor = 0;
+    bg_process *temp = find_bg_process(bg_list, pid);
+    if (temp == NULL) {
+	forget_pool_worker(bg_list, pid); //in case it was an idle worker
+	return 0;
+    }
+
+    double wall = elapsed_seconds(&temp -> started);
+    double cpu = usage -> ru_utime.tv_sec + usage -> ru_utime.tv_usec / 1e6 +
+	usage -> ru_stime.tv_sec + usage -> ru_stime.tv_usec / 1e6;
+
+    //output still in the pipes is captured before the job is reported
+    capture_bg_output(temp, 0);
+    capture_bg_output(temp, 1);
+    size_t captured = temp -> captured[0].total + temp -> captured[1].total;
+
+    if (newline_first) printf("\n");
+    print_bg_process(temp); 
+    printf("has terminated (exit %d, wall %.2fs, cpu %.2fs, max rss %ld KB",
+	   exit_status(status), wall, cpu, usage -> ru_maxrss);
+    if (temp -> captured[0].data != NULL) printf(", %zu bytes of output", captured);
+    printf(").\n");
+    log_bg_process(temp, status, usage, wall);
+    send_job_event("exited", temp, status, usage, wall);
+
+    remove_bg_process(bg_list, temp);
+    if (temp -> captured[0].data != NULL) keep_finished_bg_process(bg_list, temp);
+    else del_bg_process(temp);
+
+    start_queued_bg_processes(bg_list); //a job slot has been freed
+    return 1;
+}
+
+/*
+ * report_bg_stop
+ *
+ * Called when wait4 reports that pid has stopped or continued. If pid is a background process its
+ * state is updated, and a stop not already known is reported to the user (on a fresh line if
+ * newline_first is set).
+ * Returns 1 if a stop was reported, 0 otherwise.
+ */
+int report_bg_stop(bg_process_list *bg_list, const pid_t pid, const int status, int newline_first) {
+    bg_process *temp = find_bg_process(bg_list, pid);
+    if (temp == NULL) return 0;
+
+    int stopped = WIFSTOPPED(status);
+    if (stopped == temp -> stopped) return 0; //already known, as for a foreground job stopped with ^Z
+    set_bg_stopped(temp, stopped);
+    if (!stopped) return 0;
+
+    if (newline_first) printf("\n");
+    print_bg_process(temp);
+    printf("has stopped.\n");
+    return 1;
+}
+
+/*
+ * check_bg_process_list
+ *
+ * Reaps every child that has terminated, without blocking, collecting its rusage with wait4.
+ * If a terminated process is found in bg_list, the user is notified and bg_list is updated.
+ * Background processes that stop or continue have their state updated.
+ * When at_prompt is set the first notice starts on a new line, below the prompt that is already printed.
+ * Returns the number of background processes reported.
+ */
+int check_bg_process_list(bg_process_list *bg_list, int at_prompt){
+    int reported = 0;
+
+    pid_t pid;
+    int status;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) != 0) {
+	if (pid == -1) {
+	    if (errno == EINTR) continue;
+	    if (errno != ECHILD) printf("error with wait4, error: %s\n", strerror(errno));
+	    break;
+	}
+
+	if (WIFSTOPPED(status) || WIFCONTINUED(status))
+	    reported += report_bg_stop(bg_list, pid, status, at_prompt && (reported == 0));
+	else reported += report_bg_process(bg_list, pid, status, &usage, at_prompt && (reported == 0));
+    }
+    return reported;
+}
+
+/*
+ * print_bg_list
+ *
+ * Prints all background process in bg_list in the format specified in the assignment description,
+ * each followed by whether it is stopped or being killed, and its start time and resource usage so far,
+ * then the queued commands and the worker pools.
+ */
+void print_bg_list(const bg_process_list *bg_list){
+    for (bg_process *temp = bg_list -> head; temp != NULL; temp = temp -> next){
+	print_bg_process(temp);
+	if (temp -> kill_signal != 0) printf("[%s] ", (temp -> kill_signal == SIGKILL) ? "killed" : "terminating");
+	else if (temp -> stopped) printf("[stopped] ");
+	print_bg_usage(temp); printf("\n");
+    }
+    printf("Total Background jobs: %d\n", bg_list -> count);	
+
+    if (bg_list -> queued > 0) {
+	for (bg_process *temp = bg_list -> queue_head; temp != NULL; temp = temp -> next){
+	    printf("queued: %s/", temp -> path);
+	    for (int i = 0; temp -> args[i] != NULL; ++i) printf("%s ", temp -> args[i]);
+	    printf("\n");
+	}
+    }
+    printf("Queued jobs: %d", bg_list -> queued);
+    if (bg_list -> max_running > 0) printf(" (%d job slots)", bg_list -> max_running);
+    printf("\n");
+    print_pools(bg_list);
+}
+
+/*
+ * signal_bg_process
+ *
+ * Sends sig to every stage of job: to its process group, or to the tracked pid if the job stayed
+ * in the shell's group. Returns the result of kill.
+ */
+int signal_bg_process(const bg_process *job, const int sig) {
+    return (job -> pgid > 0) ? kill(-job -> pgid, sig) : kill(job -> pid, sig);
+}
+
+/*
+ * find_job_arg
+ *
+ * Returns the background process whose pid is given by arg, or if arg is NULL the most recently
+ * started one (the most recently started stopped one if stopped_only is set). Prints an error
+ * naming the builtin name and returns NULL if there is no such job.
+ */
+bg_process* find_job_arg(const bg_process_list *bg_list, const char *arg, const int stopped_only, const char *name) {
+    bg_process *job = NULL;
+    if (arg != NULL) job = find_bg_process(bg_list, atoi(arg));
+    else {
+	for (job = bg_list -> tail; (job != NULL) && stopped_only && !job -> stopped; job = job -> prev);
+    }
+
+    if (job == NULL) {
+	if (arg != NULL) fprintf(stderr, "ssi: %s: %s: no such job\n", name, arg);
+	else fprintf(stderr, "ssi: %s: no %sjob\n", name, stopped_only ? "stopped " : "");
+    }
+    return job;
+}
+
+/*
+ * kill_process
+ *
+ * Attempts to terminate the background processes whose pid are specified in input args. Each job
+ * is sent SIGTERM (and SIGCONT, in case it is stopped); one still running KILL_TIMEOUT seconds
+ * later is sent SIGKILL by escalate_kills. The job stays in bg_list until it has been reaped,
+ * which is reported as for any background process that terminates.
+ * Like the typical kill shell command, nothing is output to the user on success.
+ */
+void kill_process(bg_process_list *bg_list, char **args) {
+    for (int i = 1; args[i] != NULL; ++i) {	
+	bg_process *temp = find_job_arg(bg_list, args[i], 0, "kill");
+	if ((temp == NULL) || (temp -> kill_signal != 0)) continue;
+
+	if (signal_bg_process(temp, SIGTERM) == -1) {
+	    fprintf(stderr, "ssi: kill: error killing pid %d: %s\n", temp -> pid, strerror(errno));
+	    continue;
+	}
+	if (temp -> stopped) signal_bg_process(temp, SIGCONT);
+	temp -> kill_signal = SIGTERM;
+	clock_gettime(CLOCK_MONOTONIC, &temp -> kill_sent);
+	++bg_list -> terminating;
+    }    
+}
+
+/*
+ * next_kill_timeout
+ *
+ * Returns the milliseconds until the first killed job is due to be sent SIGKILL, for epoll_wait,
+ * or -1 if no job is waiting for one.
+ */
+int next_kill_timeout(const bg_process_list *bg_list) {
+    if (bg_list -> terminating == 0) return -1;
+
+    double first = KILL_TIMEOUT;
+    for (bg_process *temp = bg_list -> head; temp != NULL; temp = temp -> next) {
+	if (temp -> kill_signal != SIGTERM) continue;
+	double left = KILL_TIMEOUT - elapsed_seconds(&temp -> kill_sent);
+	if (left < first) first = left;
+    }
+    return (first > 0) ? (int)(first * 1000) + 1 : 0;
+}
+
+/*
+ * escalate_kills
+ *
+ * Sends SIGKILL to every job that kill sent SIGTERM to at least KILL_TIMEOUT seconds ago and that
+ * has not been reaped since.
+ */
+void escalate_kills(bg_process_list *bg_list) {
+    if (bg_list -> terminating == 0) return;
+
+    for (bg_process *temp = bg_list -> head; temp != NULL; temp = temp -> next) {
+	if ((temp -> kill_signal != SIGTERM) || (elapsed_seconds(&temp -> kill_sent) < KILL_TIMEOUT)) continue;
+	signal_bg_process(temp, SIGKILL);
+	temp -> kill_signal = SIGKILL;
+	--bg_list -> terminating;
+    }
+}
+
+/*
+ * stop_process
+ *
+ * Handles "stop [pid...]": stops the given background processes, or the most recent one, with
+ * SIGSTOP, which cannot be caught or ignored.
+ */
+void stop_process(bg_process_list *bg_list, char **args) {
+    for (int i = 1; (i == 1) || (args[i] != NULL); ++i) {
+	bg_process *temp = find_job_arg(bg_list, args[i], 0, "stop");
+	if (temp != NULL) {
+	    if (signal_bg_process(temp, SIGSTOP) == -1)
+		fprintf(stderr, "ssi: stop: error stopping pid %d: %s\n", temp -> pid, strerror(errno));
+	    else if (!temp -> stopped) {
+		set_bg_stopped(temp, 1);
+		print_bg_process(temp);
+		printf("has stopped.\n");
+	    }
+	}
+	if (args[i] == NULL) break;
+    }
+}
+
+/*
+ * continue_process
+ *
+ * Handles "cont [pid...]", and bg without a command: resumes the given stopped background
+ * processes, or the most recently stopped one, in the background with SIGCONT.
+ */
+void continue_process(bg_process_list *bg_list, char **args) {
+    for (int i = 1; (i == 1) || (args[i] != NULL); ++i) {
+	bg_process *temp = find_job_arg(bg_list, args[i], 1, args[0]);
+	if (temp != NULL) {
+	    if (signal_bg_process(temp, SIGCONT) == -1)
+		fprintf(stderr, "ssi: %s: error continuing pid %d: %s\n", args[0], temp -> pid, strerror(errno));
+	    else {
+		set_bg_stopped(temp, 0);
+		print_bg_process(temp);
+		printf("has resumed.\n");
+	    }
+	}
+	if (args[i] == NULL) break;
+    }
+}
+
+/*
+ * foreground_process
+ *
+ * Handles "fg [pid]": moves the given background process, or the most recent one, to the
+ * foreground. The job's process group is given the terminal and continued, and the shell waits
+ * until the job terminates, which is reported as usual, or stops again. While it waits, output
+ * of a captured job is still read into its ring buffers, so the job cannot block on a full pipe.
+ */
+void foreground_process(bg_process_list *bg_list, char **args) {
+    last_status = 1;
+    bg_process *job = find_job_arg(bg_list, args[1], 0, "fg");
+    if (job == NULL) return;
+
+    print_bg_process(job);
+    printf("\n");
+    fflush(stdout);
+    if ((shell_terminal != -1) && (job -> pgid > 0)) tcsetpgrp(shell_terminal, job -> pgid);
+    if (job -> stopped) signal_bg_process(job, SIGCONT);
+    set_bg_stopped(job, 0);
+
+    pid_t pid = job -> pid;
+    int status;
+    struct rusage usage;
+    for (;;) {
+	pid_t r = wait4(pid, &status, WUNTRACED | ((signal_fd != -1) ? WNOHANG : 0), &usage);
+	if (r == pid) break;
+	if (r == -1) {
+	    if (errno == EINTR) continue;
+	    fprintf(stderr, "ssi: fg: error waiting for pid %d: %s\n", pid, strerror(errno));
+	    reclaim_terminal();
+	    return;
+	}
+
+	//not yet changed state: sleep until a child does, or the job writes output
+	struct pollfd fds[3] = {
+	    { .fd = signal_fd, .events = POLLIN },
+	    { .fd = job -> output[0], .events = POLLIN }, //poll skips the descriptors that are -1
+	    { .fd = job -> output[1], .events = POLLIN }
+	};
+	if (poll(fds, 3, -1) == -1) continue;
+	struct signalfd_siginfo info;
+	if (fds[0].revents != 0) while (read(signal_fd, &info, sizeof(info)) == sizeof(info));
+	for (int stream = 0; stream < 2; ++stream) {
+	    if (fds[1 + stream].revents != 0) capture_bg_output(job, stream);
+	}
+    }
+    reclaim_terminal();
+
+    if (WIFSTOPPED(status)) {
+	set_bg_stopped(job, 1);
+	printf("\n");
+	print_bg_process(job);
+	printf("has stopped.\n");
+	last_status = 128 + WSTOPSIG(status);
+    }
+    else {
+	last_status = exit_status(status);
+	report_bg_process(bg_list, pid, status, &usage, last_status == 128 + SIGINT);
+    }
+    drain_sigint();
+    check_bg_process_list(bg_list, 0); //the signalfd was read above, other jobs may be waiting to be reaped
+}
+
+/*
+ * stop_foreground
+ *
+ * Called when a foreground command stops, usually on ^Z: the command becomes a stopped background
+ * process, tracked by the pid of its last stage like one started with bg, and can be resumed with
+ * fg or cont.
+ */
+void stop_foreground(bg_process_list *bg_list, const char *path, char **args, const pid_t pid, const pid_t pgid) {
+    bg_process *job = init_bg_process(pid, path, args, NULL);
+    job -> pgid = pgid;
+    job -> stopped = 1;
+    link_bg_process(bg_list, job);
+
+    printf("\n");
+    print_bg_process(job);
+    printf("has stopped.\n");
+}
+
+/*
+ * keep_finished_bg_process
+ *
+ * Keeps a terminated captured job, already removed from bg_list, so bgout can still show its
+ * output. Its pipes stay watched until end of file, for output of processes it left running.
+ * Only the BG_FINISHED_MAX most recent are kept.
+ */
+void keep_finished_bg_process(bg_process_list *bg_list, bg_process *job) {
+    job -> next = bg_list -> finished;
+    bg_list -> finished = job;
+    if (++bg_list -> num_finished <= BG_FINISHED_MAX) return;
+
+    bg_process *last = bg_list -> finished;
+    for (int i = 1; i < BG_FINISHED_MAX; ++i) last = last -> next;
+    del_bg_process(last -> next);
+    last -> next = NULL;
+    --bg_list -> num_finished;
+}
+
+/*
+ * find_captured_bg_process
+ *
+ * Returns the running or recently terminated captured job with the given pid, or NULL.
+ */
+bg_process* find_captured_bg_process(const bg_process_list *bg_list, const pid_t pid) {
+    bg_process *temp = find_bg_process(bg_list, pid);
+    if (temp == NULL) {
+	for (temp = bg_list -> finished; (temp != NULL) && (temp -> pid != pid); temp = temp -> next);
+    }
+    return ((temp != NULL) && (temp -> captured[0].data != NULL)) ? temp : NULL;
+}
+
+/*
+ * print_bg_output
+ *
+ * Handles "bgout pid": writes the captured stdout of the job to stdout and its captured stderr to
+ * stderr, after reading whatever is waiting in its pipes. Notes on stderr how much was dropped
+ * from the ring buffers or spilled to a file.
+ */
+void print_bg_output(bg_process_list *bg_list, char **args) {
+    if (args[1] == NULL) {
+	fprintf(stderr, "ssi: bgout: usage: bgout pid\n");
+	return;
+    }
+    pid_t pid = atoi(args[1]);
+    bg_process *job = find_captured_bg_process(bg_list, pid);
+    if (job == NULL) {
+	fprintf(stderr, "ssi: bgout: %s: no captured output (start the job with bg --capture)\n", args[1]);
+	return;
+    }
+
+    fflush(stdout);
+    for (int stream = 0; stream < 2; ++stream) {
+	ring_buffer *ring = &job -> captured[stream];
+	const char *name = stream ? "stderr" : "stdout";
+	capture_bg_output(job, stream);
+
+	if (ring -> dropped > 0) fprintf(stderr, "bgout: %d: %s: %zu earlier bytes dropped\n", pid, name, ring -> dropped);
+	if (ring -> spilled > 0) fprintf(stderr, "bgout: %d: %s: %zu bytes spilled to %s\n", pid, name, ring -> spilled, job -> limits.spill);
+	write_ring_buffer(ring, stream ? STDERR_FILENO : STDOUT_FILENO);
+    }
+}
+
+/*
+ * path_bucket
+ *
+ * Returns the command cache bucket of name (FNV-1a).
+ */
+unsigned path_bucket(const char *name) {
+    unsigned h = 2166136261u;
+    for (; *name != '\0'; ++name) h = (h ^ (unsigned char)*name) * 16777619u;
+    return h & (PATH_BUCKETS - 1);
+}
+
+/*
+ * clear_command_cache
+ *
+ * Forgets every cached command location.
+ */
+void clear_command_cache() {
+    for (int b = 0; b < PATH_BUCKETS; ++b) {
+	while (command_cache.buckets[b] != NULL) {
+	    path_entry *next = command_cache.buckets[b] -> next;
+	    free(command_cache.buckets[b]);
+	    command_cache.buckets[b] = next;
+	}
+    }
+    command_cache.count = 0;
+}
+
+/*
+ * forget_command
+ *
+ * Removes name from the command cache, if present.
+ */
+void forget_command(const char *name) {
+    path_entry **link = &command_cache.buckets[path_bucket(name)];
+    while ((*link != NULL) && strcmp((*link) -> name, name)) link = &(*link) -> next;
+    if (*link == NULL) return;
+
+    path_entry *rem = *link;
+    *link = rem -> next;
+    free(rem);
+    --command_cache.count;
+}
+
+/*
+ * search_path
+ *
+ * Searches the directories of PATH in order for an executable regular file called name and
+ * copies its path name into resolved (PATH_MAX bytes).
+ * Returns 1 if found with an absolute path, 2 if found relative to the current directory (an empty
+ * or relative PATH entry, which must not be cached), or 0 if not found.
+ */
+int search_path(const char *name, char *resolved) {
+    const char *path_env = getenv("PATH");
+    if (path_env == NULL) path_env = "/usr/local/bin:/usr/bin:/bin";
+
+    for (const char *dir = path_env; ; ) {
+	size_t len = strcspn(dir, ":");
+	if (len == 0) snprintf(resolved, PATH_MAX, "./%s", name);
+	else snprintf(resolved, PATH_MAX, "%.*s/%s", (int)len, dir, name);
+
+	struct stat st;
+	if ((stat(resolved, &st) == 0) && S_ISREG(st.st_mode) && (access(resolved, X_OK) == 0)) {
+	    return (resolved[0] == '/') ? 1 : 2;
+	}
+
+	if (dir[len] == '\0') break;
+	dir += len + 1;
+    }
+    return 0;
+}
+
+/*
+ * lookup_command
+ *
+ * Returns the path name to execute for name, from the command cache when possible. Names that
+ * contain a / are returned unchanged. The result is only valid until the cache is next modified.
+ * Returns NULL if the command cannot be found.
+ */
+const char* lookup_command(const char *name) {
+    static char resolved[PATH_MAX];
+
+    if (strchr(name, '/') != NULL) return name;
+
+    //a different PATH may resolve every name differently
+    const char *path_env = getenv("PATH");
+    if ((command_cache.path_env == NULL) != (path_env == NULL) ||
+	((path_env != NULL) && strcmp(path_env, command_cache.path_env))) {
+	clear_command_cache();
+	free(command_cache.path_env);
+	command_cache.path_env = (path_env != NULL) ? strdup(path_env) : NULL;
+    }
+
+    unsigned b = path_bucket(name);
+    for (path_entry *temp = command_cache.buckets[b]; temp != NULL; temp = temp -> next) {
+	if (!strcmp(temp -> name, name)) {
+	    ++temp -> hits;
+	    return temp -> path;
+	}
+    }
+
+    int found = search_path(name, resolved);
+    if (found != 1) return found ? resolved : NULL;
+
+    path_entry *new = malloc(sizeof(path_entry) + strlen(name) + strlen(resolved) + 2);
+    new -> name = (char*)(new + 1);
+    new -> path = stpcpy(new -> name, name) + 1;
+    strcpy(new -> path, resolved);
+    new -> hits = 1;
+    new -> next = command_cache.buckets[b];
+    command_cache.buckets[b] = new;
+    ++command_cache.count;
+    return new -> path;
+}
+
+/*
+ * hash_command
+ *
+ * The hash builtin. With no arguments, lists the cached commands with the number of times each
+ * has been used; hash -r empties the cache; hash name... looks each name up and caches it.
+ */
+void hash_command(char **args) {
+    if (args[1] == NULL) {
+	if (command_cache.count == 0) printf("hash: hash table empty\n");
+	else printf("hits\tcommand\n");
+	for (int b = 0; b < PATH_BUCKETS; ++b) {
+	    for (path_entry *temp = command_cache.buckets[b]; temp != NULL; temp = temp -> next) {
+		printf("%4d\t%s\n", temp -> hits, temp -> path);
+	    }
+	}
+	return;
+    }
+
+    if (!strcmp(args[1], "-r")) {
+	clear_command_cache();
+	return;
+    }
+
+    for (int i = 1; args[i] != NULL; ++i) {
+	forget_command(args[i]);
+	if (lookup_command(args[i]) == NULL) fprintf(stderr, "ssi: hash: %s: not found\n", args[i]);
+    }
+}
+
+/*
+ * parse_cpu_list
+ *
+ * Parses a CPU list such as 0-3,6 into cpus. Returns 0 on success, -1 if the list is malformed.
+ */
+int parse_cpu_list(const char *list, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    const char *c = list;
+    do {
+	char *end;
+	long first = strtol(c, &end, 10);
+	long last = first;
+	if (end == c) return -1;
+	if (*end == '-') {
+	    c = end + 1;
+	    last = strtol(c, &end, 10);
+	    if (end == c) return -1;
+	}
+	if ((first < 0) || (last < first) || (last >= CPU_SETSIZE)) return -1;
+	for (long cpu = first; cpu <= last; ++cpu) CPU_SET(cpu, cpus);
+	c = end;
+    } while ((*c++ == ',') && (*c != '\0'));
+    return (c[-1] == '\0') ? 0 : -1;
+}
+
+/*
+ * parse_job_options
+ *
+ * Parses the --cpus=, --mem=, --nice=, --cgroup=, --capture and --spill= options at the start of args
+ * into limits. --spill implies --capture.
+ * --mem takes a byte count with an optional K, M, G or T suffix. A relative --cgroup directory
+ * is taken under /sys/fs/cgroup. The cgroup and spill strings point into args.
+ * Returns the number of args consumed, or -1 after printing an error.
+ */
+int parse_job_options(char **args, job_limits *limits) {
+    memset(limits, 0, sizeof(job_limits));
+
+    int i;
+    for (i = 0; (args[i] != NULL) && !strncmp(args[i], "--", 2); ++i) {
+	char *value = strchr(args[i], '=');
+	char *end = NULL;
+	if (!strcmp(args[i], "--capture")) {
+	    limits -> capture = 1;
+	    continue;
+	}
+	if (value == NULL) {
+	    fprintf(stderr, "ssi: bg: error, option %s needs a value\n", args[i]);
+	    return -1;
+	}
+	++value;
+
+	if (!strncmp(args[i], "--cpus=", 7)) {
+	    limits -> has_cpus = 1;
+	    if (parse_cpu_list(value, &limits -> cpus) == 0) continue;
+	}
+	else if (!strncmp(args[i], "--mem=", 6)) {
+	    unsigned long long bytes = strtoull(value, &end, 10);
+	    const char *units = "KMGT";
+	    const char *unit = strchr(units, *end & ~0x20);
+	    if ((*end != '\0') && (unit != NULL)) {
+		bytes <<= 10 * (unit - units + 1);
+		++end;
+	    }
+	    limits -> mem = bytes;
+	    if ((end != value) && (*end == '\0') && (bytes > 0)) continue;
+	}
+	else if (!strncmp(args[i], "--nice=", 7)) {
+	    limits -> has_nice = 1;
+	    limits -> nice = strtol(value, &end, 10);
+	    if ((end != value) && (*end == '\0')) continue;
+	}
+	else if (!strncmp(args[i], "--cgroup=", 9)) {
+	    limits -> cgroup = value;
+	    if (*value != '\0') continue;
+	}
+	else if (!strncmp(args[i], "--spill=", 8)) {
+	    limits -> capture = 1;
+	    limits -> spill = value;
+	    if (*value != '\0') continue;
+	}
+	else {
+	    fprintf(stderr, "ssi: bg: error, unknown option %s\n", args[i]);
+	    return -1;
+	}
+	fprintf(stderr, "ssi: bg: error, invalid value in %s\n", args[i]);
+	return -1;
+    }
+    return i;
+}
+
+/*
+ * apply_job_limits
+ *
+ * Applies limits to the calling process; called in the child between fork and exec so they are
+ * inherited by the command. Joining the cgroup comes first, creating its directory if needed,
+ * so the cgroup's own controllers also apply. Returns 0 on success, -1 after printing an error.
+ */
+int apply_job_limits(const job_limits *limits) {
+    if (limits -> cgroup != NULL) {
+	char procs[PATH_MAX];
+	int n = snprintf(procs, PATH_MAX, "%s%s", (limits -> cgroup[0] == '/') ? "" : "/sys/fs/cgroup/", limits -> cgroup);
+	if ((mkdir(procs, 0755) == -1) && (errno != EEXIST)) {
+	    fprintf(stderr, "ssi: bg: %s: %s\n", procs, strerror(errno));
+	    return -1;
+	}
+	snprintf(procs + n, PATH_MAX - n, "/cgroup.procs");
+	int fd = open(procs, O_WRONLY | O_CLOEXEC);
+	if ((fd == -1) || (write(fd, "0", 1) == -1)) { //"0" moves the writing process
+	    fprintf(stderr, "ssi: bg: %s: %s\n", procs, strerror(errno));
+	    return -1;
+	}
+	close(fd);
+    }
+    if (limits -> has_cpus && (sched_setaffinity(0, sizeof(cpu_set_t), &limits -> cpus) == -1)) {
+	fprintf(stderr, "ssi: bg: error setting CPU affinity: %s\n", strerror(errno));
+	return -1;
+    }
+    if (limits -> mem > 0) {
+	struct rlimit rl = { .rlim_cur = limits -> mem, .rlim_max = limits -> mem };
+	if (setrlimit(RLIMIT_AS, &rl) == -1) {
+	    fprintf(stderr, "ssi: bg: error limiting memory: %s\n", strerror(errno));
+	    return -1;
+	}
+    }
+    if (limits -> has_nice) {
+	errno = 0;
+	if ((nice(limits -> nice) == -1) && (errno != 0)) {
+	    fprintf(stderr, "ssi: bg: error setting nice value: %s\n", strerror(errno));
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * init_job_child
+ *
+ * Called in a forked child before it runs its command. Moves the child into process group pgid,
+ * or a new group of its own if pgid is 0 (nothing is done for -1), and if foreground is set gives
+ * the new group the terminal. The job control signals the shell ignores are restored to their
+ * default action, since an ignored signal stays ignored across exec.
+ */
+void init_job_child(const pid_t pgid, const int foreground) {
+    if (pgid != -1) setpgid(0, pgid);
+    if ((pgid == 0) && foreground && (shell_terminal != -1)) tcsetpgrp(shell_terminal, getpid());
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+}
+
+/*
+ * launch_process
+ *
+ * Starts the command in args without waiting for it and returns its pid, or -1 if it could not be run,
+ * including when fork fails.
+ * in_fd, out_fd and err_fd, when not -1, become the child's stdin, stdout and stderr.
+ * The child joins process group pgid, or leads a new one if pgid is 0, or stays in the shell's if
+ * pgid is -1. A new group started with foreground set is given the terminal before the command runs.
+ * posix_spawn is used by default: glibc implements it with clone(CLONE_VM | CLONE_VFORK), so unlike
+ * fork the cost does not grow with the size of the shell's address space. If the process itself
+ * could not be created (or --fork was given), falls back to fork and execv; a cached command
+ * location that is no longer executable is then forgotten and PATH searched again before forking.
+ * Jobs with limits always use fork, as posix_spawn cannot set affinity, rlimits or priority;
+ * the limits are applied in the child just before execv.
+ * All descriptors the shell opens are close-on-exec, so the child only keeps stdin, stdout and stderr.
+ * dir, when not NULL, is the directory the command runs in. The child changes into it itself, so
+ * the shell's own working directory is never touched; a relative command name is found from there.
+ */
+pid_t launch_process(char **args, const int in_fd, const int out_fd, const int err_fd,
+		     const pid_t pgid, const int foreground, const job_limits *limits, const char *dir) {
+    pid_t pid;
+    char file[PATH_MAX];
+    int limited = (limits != NULL) &&
+	(limits -> has_cpus || (limits -> mem > 0) || limits -> has_nice || (limits -> cgroup != NULL));
+    int handoff = (pgid == 0) && foreground && (shell_terminal != -1);
+    sigset_t unblocked; //the signals the event loop blocks must reach the command
+    sigemptyset(&unblocked);
+    sigset_t defaults; //the job control signals the interactive shell ignores
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+
+    //resolved through the command cache so PATH is not searched again, then executed with execv semantics
+    const char *resolved = lookup_command(args[0]);
+    if (resolved == NULL) {
+	fprintf(stderr, "ssi: execute: %s: command not found\n", args[0]);
+	return -1;
+    }
+    snprintf(file, PATH_MAX, "%s", resolved);
+
+    fflush(stdout); //the child must not inherit (and later repeat) buffered output
+
+    if (!launch_with_fork && !limited && (!handoff || SPAWN_TCSETPGRP) && ((dir == NULL) || SPAWN_CHDIR)) {
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+#if SPAWN_CHDIR
+	if (dir != NULL) posix_spawn_file_actions_addchdir_np(&actions, dir);
+#endif
+	if (in_fd != -1) posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+	if (out_fd != -1) posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+	if (err_fd != -1) posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+#if SPAWN_TCSETPGRP
+	//runs after the child has joined its new group, with every signal still blocked
+	if (handoff) posix_spawn_file_actions_addtcsetpgrp_np(&actions, shell_terminal);
+#endif
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &unblocked);
+	posix_spawnattr_setsigdefault(&attr, &defaults);
+	short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+	if (pgid != -1) {
+	    posix_spawnattr_setpgroup(&attr, pgid);
+	    flags |= POSIX_SPAWN_SETPGROUP;
+	}
+	posix_spawnattr_setflags(&attr, flags);
+
+	int err = posix_spawn(&pid, file, &actions, &attr, args, environ);
+	if (((err == ENOENT) || (err == EACCES)) && (strchr(args[0], '/') == NULL)) {
+	    //the cached location has gone away, search PATH again
+	    forget_command(args[0]);
+	    resolved = lookup_command(args[0]);
+	    if (resolved == NULL) {
+		posix_spawn_file_actions_destroy(&actions);
+		posix_spawnattr_destroy(&attr);
+		fprintf(stderr, "ssi: execute: %s: command not found\n", args[0]);
+		return -1;
+	    }
+	    snprintf(file, PATH_MAX, "%s", resolved);
+	    err = posix_spawn(&pid, file, &actions, &attr, args, environ);
+	}
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	if (err == 0) return pid;
+	if ((err != EAGAIN) && (err != ENOMEM) && (err != ENOSYS)) { //the command could not be executed
+	    if ((dir != NULL) && (access(dir, X_OK) == -1)) fprintf(stderr, "ssi: execute: %s: %s\n", dir, strerror(errno));
+	    else fprintf(stderr, "ssi: execute: %s: %s\n", args[0], strerror(err));
+	    if (strchr(args[0], '/') == NULL) forget_command(args[0]);
+	    return -1;
+	}
+    }
+
+    //the child of fork cannot tell the shell that a cached location has gone away, so it is checked first
+    if ((strchr(args[0], '/') == NULL) && (access(file, X_OK) == -1)) {
+	forget_command(args[0]);
+	resolved = lookup_command(args[0]);
+	if (resolved == NULL) {
+	    fprintf(stderr, "ssi: execute: %s: command not found\n", args[0]);
+	    return -1;
+	}
+	snprintf(file, PATH_MAX, "%s", resolved);
+    }
+
+    pid = fork();
+    if (pid < 0) { //under memory or process pressure, which the shell must survive
+	fprintf(stderr, "ssi: execute: %s: fork failed: %s\n", args[0], strerror(errno));
+	return -1;
+    }
+    else if (pid == 0) { //child, which leaves with _exit so the shell's stdio buffers are not flushed twice
+	if (in_fd != -1) dup2(in_fd, STDIN_FILENO);
+	if (out_fd != -1) dup2(out_fd, STDOUT_FILENO);
+	if (err_fd != -1) dup2(err_fd, STDERR_FILENO);
+	init_job_child(pgid, foreground);
+	sigprocmask(SIG_SETMASK, &unblocked, NULL);
+	if ((dir != NULL) && (chdir(dir) == -1)) {
+	    fprintf(stderr, "ssi: execute: %s: %s\n", dir, strerror(errno));
+	    _exit(126);
+	}
+	if (limited && (apply_job_limits(limits) == -1)) _exit(126);
+	if(execv(file, args) == -1) fprintf(stderr, "ssi: execute: error execv failed\n");
+	_exit(1);
+    }
+    //also done by the parent, so the group exists before the next stage of a pipeline joins it
+    if (pgid != -1) setpgid(pid, (pgid == 0) ? pid : pgid);
+    return pid;
+}
+
+/*
+ * relay_tee
+ *
+ * Copies everything from in to out and to each of files until in reaches end of file.
+ * When in and out are both pipes and there is a single file, the data never enters user space:
+ * tee() duplicates the pending input into out, then splice() moves the same bytes into the file.
+ * Otherwise falls back to read and write.
+ */
+void relay_tee(const int in, const int out, const int *files, const int num_files) {
+    struct stat in_st, out_st;
+    int zero_copy = (num_files == 1) && (fstat(in, &in_st) == 0) && S_ISFIFO(in_st.st_mode) &&
+	(fstat(out, &out_st) == 0) && S_ISFIFO(out_st.st_mode);
+
+    while (zero_copy) {
+	ssize_t n = tee(in, out, 1 << 16, 0);
+	if (n == 0) return;
+	if (n < 0) {
+	    if (errno == EINTR) continue;
+	    zero_copy = 0; //nothing has been consumed from in, carry on with read and write
+	    break;
+	}
+	while (n > 0) {
+	    ssize_t moved = splice(in, NULL, files[0], NULL, n, SPLICE_F_MOVE);
+	    if (moved <= 0) {
+		if ((moved < 0) && (errno == EINTR)) continue;
+		fprintf(stderr, "ssi: tee: error writing file: %s\n", strerror(errno));
+		return;
+	    }
+	    n -= moved;
+	}
+    }
+
+    char buffer[1 << 16];
+    for (;;) {
+	ssize_t n = read(in, buffer, sizeof(buffer));
+	if (n == 0) return;
+	if (n < 0) {
+	    if (errno == EINTR) continue;
+	    return;
+	}
+	for (int f = -1; f < num_files; ++f) {
+	    int fd = (f == -1) ? out : files[f];
+	    for (ssize_t done = 0; done < n; ) {
+		ssize_t w = write(fd, buffer + done, n - done);
+		if (w < 0) {
+		    if (errno == EINTR) continue;
+		    return;
+		}
+		done += w;
+	    }
+	}
+    }
+}
+
+/*
+ * parse_tee_options
+ *
+ * Reads the options of the tee builtin: -a (append to the files), -i (ignore SIGINT), combined as
+ * in -ai, and -- to end the options. append and ignore_interrupts, when not NULL, receive them.
+ * Returns the index of the first file in args, or -1 if an option is one the builtin does not
+ * support, in which case the tee command found in PATH is run instead.
+ */
+int parse_tee_options(char **args, int *append, int *ignore_interrupts) {
+    int a = 0, i = 0;
+    int first;
+    for (first = 1; (args[first] != NULL) && (args[first][0] == '-') && (args[first][1] != '\0'); ++first) {
+	if (!strcmp(args[first], "--")) {
+	    ++first;
+	    break;
+	}
+	for (const char *c = args[first] + 1; *c != '\0'; ++c) {
+	    if (*c == 'a') a = 1;
+	    else if (*c == 'i') i = 1;
+	    else return -1;
+	}
+    }
+    if (append != NULL) *append = a;
+    if (ignore_interrupts != NULL) *ignore_interrupts = i;
+    return first;
+}
+
+/*
+ * launch_tee
+ *
+ * Runs the tee builtin (tee [-a] [-i] file...) as a pipeline stage in a child of the shell, relaying
+ * its stdin to its stdout and to each file with relay_tee. limits, when not NULL, apply to the child.
+ * pgid and foreground select its process group, and dir its directory, as for launch_process.
+ * Returns the pid of the child, or -1.
+ */
+pid_t launch_tee(char **args, const int in_fd, const int out_fd, const int err_fd,
+		 const pid_t pgid, const int foreground, const job_limits *limits, const char *dir) {
+    int append, ignore_interrupts;
+    int first = parse_tee_options(args, &append, &ignore_interrupts);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+	fprintf(stderr, "ssi: tee: fork failed: %s\n", strerror(errno));
+	return -1;
+    }
+    else if (pid == 0) { //child, which leaves with _exit as in launch_process
+	if (err_fd != -1) dup2(err_fd, STDERR_FILENO);
+	init_job_child(pgid, foreground);
+	if ((dir != NULL) && (chdir(dir) == -1)) {
+	    fprintf(stderr, "ssi: tee: %s: %s\n", dir, strerror(errno));
+	    _exit(126);
+	}
+	if ((limits != NULL) && (apply_job_limits(limits) == -1)) _exit(126);
+
+	int num_files = 0;
+	for (int i = first; args[i] != NULL; ++i) ++num_files;
+
+	int *files = malloc(sizeof(int) * (num_files + 1));
+	for (int i = 0; i < num_files; ++i) {
+	    files[i] = open(args[first + i], O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0666);
+	    if (files[i] == -1) {
+		fprintf(stderr, "ssi: tee: %s: %s\n", args[first + i], strerror(errno));
+		_exit(1);
+	    }
+	}
+
+	if (ignore_interrupts) signal(SIGINT, SIG_IGN);
+	sigset_t unblocked;
+	sigemptyset(&unblocked);
+	sigprocmask(SIG_SETMASK, &unblocked, NULL);
+	relay_tee((in_fd != -1) ? in_fd : STDIN_FILENO, (out_fd != -1) ? out_fd : STDOUT_FILENO, files, num_files);
+	_exit(0);
+    }
+    if (pgid != -1) setpgid(pid, (pgid == 0) ? pid : pgid);
+    return pid;
+}
+
+/*
+ * count_stages
+ *
+ * Returns the number of pipeline stages in args, one more than the number of | args.
+ */
+int count_stages(char **args) {
+    int stages = 1;
+    for (int i = 0; args[i] != NULL; ++i) {
+	if (!strcmp(args[i], "|")) ++stages;
+    }
+    return stages;
+}
+
+/*
+ * launch_pipeline
+ *
+ * Splits args at | into stages and starts every stage directly, with each stage's stdout connected
+ * to the next stage's stdin by a pipe. Within a stage, "< file", "> file" and ">> file" redirect
+ * stdin or stdout; the files are opened by the shell so errors are reported before anything runs.
+ * A stage named tee is handled by launch_tee, so it shadows the tee in PATH, unless it is given an
+ * option the builtin does not support (see parse_tee_options); /usr/bin/tee, or any other path,
+ * always runs the external command.
+ * If pids is not NULL it receives the pid of every stage (-1 for a stage that could not be started).
+ * limits, when not NULL, are applied to every stage. dir, when not NULL, is the directory every
+ * stage runs in, and relative redirections are opened from there. output, when not NULL, holds the descriptors
+ * that become stdout of the last stage (unless redirected) and stderr of every stage.
+ * group is one of the GROUP_ values; outside the interactive shell every pipeline stays in the
+ * shell's process group. If pgid is not NULL it receives the process group of the stages, or 0.
+ * Returns the pid of the last stage, whose exit status is the status of the pipeline, or -1.
+ */
+pid_t launch_pipeline(char **args, pid_t *pids, const job_limits *limits, const char *dir, const int *output,
+		      const int group, pid_t *pgid) {
+    int num_args = 0;
+    while (args[num_args] != NULL) ++num_args;
+
+    char **stage = malloc(sizeof(char*) * (num_args + 1));
+    int stage_in = -1; //read end of the pipe from the previous stage
+    pid_t last = -1;
+    int index = 0;
+    //the first stage started leads the group and the others join it
+    pid_t leader = ((group == GROUP_SHELL) || (event_fd == -1)) ? -1 : 0;
+
+    for (int i = 0; i <= num_args; ++index) {
+	int n = 0;
+	int in_fd = -1, out_fd = -1;
+	int error = 0;
+
+	for (; (args[i] != NULL) && strcmp(args[i], "|"); ++i) {
+	    int redirect_in = !strcmp(args[i], "<");
+	    int redirect_out = !strcmp(args[i], ">") || !strcmp(args[i], ">>");
+	    if (!redirect_in && !redirect_out) {
+		stage[n++] = args[i];
+		continue;
+	    }
+
+	    char *file = args[i + 1];
+	    if ((file == NULL) || !strcmp(file, "|") || !strcmp(file, "<") || !strcmp(file, ">") || !strcmp(file, ">>")) {
+		fprintf(stderr, "ssi: execute: error, %s without a file name\n", args[i]);
+		error = 1;
+		break;
+	    }
+	    char in_dir[PATH_MAX];
+	    if ((dir != NULL) && (file[0] != '/')) {
+		snprintf(in_dir, PATH_MAX, "%s/%s", dir, file);
+		file = in_dir;
+	    }
+	    int *fd = redirect_in ? &in_fd : &out_fd;
+	    if (*fd != -1) close(*fd);
+	    *fd = redirect_in ? open(file, O_RDONLY | O_CLOEXEC) :
+		open(file, O_WRONLY | O_CREAT | O_CLOEXEC | (strcmp(args[i], ">>") ? O_TRUNC : O_APPEND), 0666);
+	    if (*fd == -1) {
+		fprintf(stderr, "ssi: %s: %s\n", file, strerror(errno));
+		error = 1;
+		break;
+	    }
+	    ++i;
+	}
+	stage[n] = NULL;
+	int is_last = (args[i] == NULL) || error;
+	if (!error && (n == 0)) {
+	    fprintf(stderr, "ssi: execute: error, empty command in pipeline\n");
+	    error = 1;
+	}
+
+	//a redirection takes precedence over the pipe on the same side
+	int next_in = -1;
+	if (!is_last) {
+	    int fds[2];
+	    if (pipe2(fds, O_CLOEXEC) == -1) {
+		fprintf(stderr, "ssi: execute: error creating pipe: %s\n", strerror(errno));
+		error = 1;
+	    }
+	    else {
+		next_in = fds[0];
+		if (out_fd == -1) out_fd = fds[1];
+		else close(fds[1]);
+	    }
+	}
+	if (in_fd == -1) in_fd = stage_in;
+	else if (stage_in != -1) close(stage_in);
+	if (is_last && !error && (out_fd == -1) && (output != NULL)) out_fd = fcntl(output[0], F_DUPFD_CLOEXEC, 0);
+	int err_fd = (output != NULL) ? output[1] : -1;
+
+	pid_t pid = -1;
+	const int foreground = (group == GROUP_FOREGROUND);
+	int builtin_tee = !error && !strcmp(stage[0], "tee") && (parse_tee_options(stage, NULL, NULL) != -1);
+	if (!error) pid = builtin_tee ? launch_tee(stage, in_fd, out_fd, err_fd, leader, foreground, limits, dir) :
+			launch_process(stage, in_fd, out_fd, err_fd, leader, foreground, limits, dir);
+	if ((pid > 0) && (leader == 0)) leader = pid;
+	if (pids != NULL) pids[index] = pid;
+	last = pid;
+
+	if (in_fd != -1) close(in_fd);
+	if (out_fd != -1) close(out_fd);
+	stage_in = next_in;
+
+	if (error) {
+	    if (stage_in != -1) close(stage_in);
+	    for (int k = index + 1; (pids != NULL) && (k < count_stages(args)); ++k) pids[k] = -1;
+	    break;
+	}
+	++i; //skip the |
+    }
+
+    free(stage);
+    if (pgid != NULL) *pgid = (leader > 0) ? leader : 0;
+    return last;
+}
+
+/*
+ * exit_status
+ *
+ * Converts a wait status into a shell exit status: the exit code, or 128 plus the signal number.
+ */
+int exit_status(const int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return 1;
+}
+
+/*
+ * compare_doubles
+ *
+ * qsort comparison function for doubles in ascending order.
+ */
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * print_bench_row
+ *
+ * Sorts the n values, in seconds, and prints their 50th, 90th and 99th percentiles (nearest rank)
+ * and their mean in milliseconds.
+ */
+void print_bench_row(const char *name, double *values, const int n) {
+    qsort(values, n, sizeof(double), compare_doubles);
+    const int percentiles[3] = {50, 90, 99};
+
+    double sum = 0;
+    for (int i = 0; i < n; ++i) sum += values[i];
+
+    printf("%-8s", name);
+    for (int p = 0; p < 3; ++p) {
+	int rank = (percentiles[p] * n + 99) / 100; //ceil(p / 100 * n)
+	printf("%12.3f", values[(rank > 0) ? rank - 1 : 0] * 1e3);
+    }
+    printf("%12.3f\n", sum / n * 1e3);
+}
+
+/*
+ * bench_command
+ *
+ * Handles "bench N [-j K] cmd": runs cmd N times with at most K runs at once and reports, per run,
+ * the wall time from launch to reaping, the time taken to start the process (fork and exec, or
+ * posix_spawn, which returns once the exec has happened) and the user and system CPU time from
+ * wait4. Times come from CLOCK_MONOTONIC. cmd may use redirections but not pipes.
+ * Launching stops at the first run that cannot be started, or on ^C.
+ * last_status is 0 if every run exited with status 0, 1 otherwise.
+ */
+void bench_command(char **args, bg_process_list *bg_list) {
+    int n = (args[1] != NULL) ? atoi(args[1]) : 0;
+    int k = 1;
+    char **cmd = args + 2;
+    if ((args[1] != NULL) && (args[2] != NULL) && !strcmp(args[2], "-j")) {
+	k = (args[3] != NULL) ? atoi(args[3]) : 0;
+	cmd = (args[3] != NULL) ? args + 4 : args + 3;
+    }
+    last_status = 2;
+    if ((n < 1) || (k < 1) || (cmd[0] == NULL)) {
+	fprintf(stderr, "ssi: bench: usage: bench N [-j K] cmd\n");
+	return;
+    }
+    if (count_stages(cmd) > 1) {
+	fprintf(stderr, "ssi: bench: error, pipelines cannot be benchmarked\n");
+	return;
+    }
+    if (k > n) k = n;
+
+    double *times = malloc(sizeof(double) * n * 4);
+    double *wall = times, *spawn = times + n, *user = times + 2 * n, *sys = times + 3 * n;
+    bench_run *running = malloc(sizeof(bench_run) * k);
+    int num_running = 0, launched = 0, finished = 0, failed = 0, interrupted = 0;
+    sigset_t pending;
+
+    while (finished < launched || (launched < n)) {
+	while ((launched < n) && (num_running < k)) {
+	    struct timespec before;
+	    clock_gettime(CLOCK_MONOTONIC, &before);
+	    pid_t pid;
+	    launch_pipeline(cmd, &pid, NULL, NULL, NULL, GROUP_SHELL, NULL); //^C reaches the runs and the shell
+	    if (pid <= 0) {
+		n = launched; //nothing more is started, the runs so far are still reported
+		break;
+	    }
+	    spawn[launched] = elapsed_seconds(&before);
+	    running[num_running].pid = pid;
+	    running[num_running].index = launched++;
+	    running[num_running++].started = before;
+	}
+	if (num_running == 0) break;
+
+	int status;
+	struct rusage usage;
+	pid_t pid = wait4(-1, &status, 0, &usage);
+	if (pid == -1) {
+	    if (errno == EINTR) continue;
+	    break;
+	}
+
+	int i;
+	for (i = 0; (i < num_running) && (running[i].pid != pid); ++i);
+	if (i == num_running) {
+	    report_bg_process(bg_list, pid, status, &usage, 0);
+	    continue;
+	}
+	int index = running[i].index;
+	wall[index] = elapsed_seconds(&running[i].started);
+	user[index] = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+	sys[index] = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	if (exit_status(status) != 0) ++failed;
+	running[i] = running[--num_running];
+	++finished;
+
+	//^C is delivered to the runs; the shell's copy stops further launches
+	if (!interrupted && (signal_fd != -1) && (sigpending(&pending) == 0) && sigismember(&pending, SIGINT)) {
+	    interrupted = 1;
+	    n = launched;
+	}
+    }
+    drain_sigint();
+    if (interrupted) printf("\n");
+
+    if (finished > 0) {
+	printf("bench: %d runs of %s, %d at a time, %d failed\n", finished, cmd[0], k, failed);
+	printf("%-8s%12s%12s%12s%12s\n", "ms", "p50", "p90", "p99", "mean");
+	print_bench_row("wall", wall, finished);
+	print_bench_row("spawn", spawn, finished);
+	print_bench_row("user", user, finished);
+	print_bench_row("sys", sys, finished);
+    }
+    last_status = ((finished > 0) && (failed == 0) && (finished == launched)) ? 0 : 1;
+
+    free(times);
+    free(running);
+}
+
+/*
+ * open_history
+ *
+ * Opens (creating it if needed) the history log, $SSI_HISTORY or ~/.ssi_history. Nothing is read
+ * yet, so startup does not depend on the size of the history.
+ */
+void open_history() {
+    char path[PATH_MAX];
+    const char *file = getenv("SSI_HISTORY");
+    const char *home = getenv("HOME");
+    history.fd = -1;
+    if ((file == NULL) && (home != NULL)) {
+	snprintf(path, PATH_MAX, "%s/%s", home, HISTORY_FILE);
+	file = path;
+    }
+    if (file == NULL) return;
+
+    history.path = strdup(file);
+    history.fd = open(file, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (history.fd == -1) fprintf(stderr, "ssi: history: %s: %s\n", file, strerror(errno));
+}
+
+/*
+ * reset_history
+ *
+ * Forgets the mapping and both indexes, after the log has been replaced or truncated.
+ */
+void reset_history() {
+    if (history.map != NULL) munmap(history.map, history.mapped);
+    history.map = NULL;
+    history.mapped = 0;
+    history.indexed = 0;
+    history.count = 0;
+    free(history.sorted);
+    history.sorted = NULL;
+    history.num_sorted = 0;
+    history.sorted_upto = 0;
+}
+
+/*
+ * add_history
+ *
+ * Appends line to the history log. The write happens under an exclusive flock, after checking that
+ * the log has not been replaced by a compaction since it was opened, so no entry is lost.
+ * Blank lines are not recorded.
+ */
+void add_history(const char *line) {
+    if ((history.fd == -1) || (line[strspn(line, " \t")] == '\0')) return;
+
+    for (;;) {
+	struct stat st_path, st_fd;
+	if (flock(history.fd, LOCK_EX) == -1) return;
+	if ((stat(history.path, &st_path) == -1) || (fstat(history.fd, &st_fd) == -1) ||
+	    (st_path.st_ino == st_fd.st_ino)) break;
+
+	close(history.fd); //also releases the lock
+	history.fd = open(history.path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (history.fd == -1) return;
+    }
+
+    struct iovec parts[2] = {
+	{ .iov_base = (char*)line, .iov_len = strlen(line) },
+	{ .iov_base = "\n", .iov_len = 1 }
+    };
+    writev(history.fd, parts, 2); //a single write with O_APPEND, lines of concurrent sessions do not mix
+    flock(history.fd, LOCK_UN);
+}
+
+/*
+ * load_history
+ *
+ * Brings the in-memory view of the log up to date: maps it again if it has grown (or been replaced)
+ * and adds every complete line after history.indexed to history.entries.
+ * Returns 0 on success, -1 if there is no history.
+ */
+int load_history() {
+    struct stat st, st_path;
+    if ((history.fd == -1) || (fstat(history.fd, &st) == -1)) return -1;
+    if ((stat(history.path, &st_path) == 0) && (st_path.st_ino != st.st_ino)) { //compacted by another process
+	close(history.fd);
+	history.fd = open(history.path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if ((history.fd == -1) || (fstat(history.fd, &st) == -1)) return -1;
+    }
+    if ((history.map != NULL) && ((st.st_ino != history.inode) || ((size_t)st.st_size < history.indexed)))
+	reset_history();
+
+    if ((size_t)st.st_size > history.mapped) {
+	if (history.map != NULL) munmap(history.map, history.mapped);
+	history.map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history.fd, 0);
+	if (history.map == MAP_FAILED) {
+	    history.map = NULL;
+	    history.mapped = 0;
+	    reset_history();
+	    return -1;
+	}
+	history.mapped = st.st_size;
+	history.inode = st.st_ino;
+    }
+    if (history.map == NULL) return 0; //empty log
+
+    //a line is only complete once its newline is there
+    char *c = history.map + history.indexed;
+    char *end = history.map + history.mapped;
+    char *newline;
+    while ((newline = memchr(c, '\n', end - c)) != NULL) {
+	if (history.count == history.capacity) {
+	    history.capacity = (history.capacity > 0) ? 2 * history.capacity : 1024;
+	    history.entries = realloc(history.entries, sizeof(history_entry) * history.capacity);
+	}
+	history.entries[history.count].offset = c - history.map;
+	history.entries[history.count].len = newline - c;
+	history.entries[history.count].key = history_key(&history.entries[history.count], 0);
+	++history.count;
+	c = newline + 1;
+    }
+    history.indexed = c - history.map;
+    return 0;
+}
+
+/*
+ * compare_history
+ *
+ * qsort comparison function ordering history entries by text, then by age.
+ */
+int compare_history(const void *a, const void *b) {
+    const history_entry *x = a, *y = b;
+    if (x -> key != y -> key) return (x -> key < y -> key) ? -1 : 1;
+    int r = memcmp(history.map + x -> offset, history.map + y -> offset, (x -> len < y -> len) ? x -> len : y -> len);
+    if (r != 0) return r;
+    if (x -> len != y -> len) return (x -> len < y -> len) ? -1 : 1;
+    return (x -> offset > y -> offset) - (x -> offset < y -> offset);
+}
+
+/*
+ * compare_history_age
+ *
+ * qsort comparison function ordering history entries from oldest to most recent.
+ */
+int compare_history_age(const void *a, const void *b) {
+    const history_entry *x = a, *y = b;
+    return (x -> offset > y -> offset) - (x -> offset < y -> offset);
+}
+
+/*
+ * history_key
+ *
+ * Returns bytes 8 * depth to 8 * depth + 7 of the command of entry as a big-endian number, padded
+ * with zeros past its end, so comparing keys compares that part of the text.
+ */
+uint64_t history_key(const history_entry *entry, const int depth) {
+    const unsigned char *c = (const unsigned char*)history.map + entry -> offset;
+    uint64_t key = 0;
+    const unsigned first = 8 * (unsigned)depth;
+    for (unsigned i = first; i < first + 8; ++i) key = (key << 8) | ((i < entry -> len) ? c[i] : 0);
+    return key;
+}
+
+/*
+ * radix_sort_history
+ *
+ * Sorts entries, which share their first 8 * depth bytes and are in chronological order, in the
+ * order of compare_history. A comparison sort of a large history spends most of its time on cache
+ * misses into the log, so this is an MSD radix sort 8 bytes at a time: each level reads the next
+ * 8 bytes of every entry once, radix sorts by them (stable, so equal commands stay in order of
+ * age) and recurses into runs that are still equal and not yet at their end. Short runs are
+ * left to qsort. Keys are left as they were for depth 0.
+ */
+void radix_sort_history(history_entry *entries, const int n, const int depth) {
+    if ((depth > 0) && (n < 64)) { //the keys are all equal, so compare_history compares the text
+	qsort(entries, n, sizeof(history_entry), compare_history);
+	for (int i = 0; i < n; ++i) entries[i].key = history_key(&entries[i], 0);
+	return;
+    }
+    if (depth > 0) {
+	for (int i = 0; i < n; ++i) entries[i].key = history_key(&entries[i], depth);
+    }
+
+    history_entry *from = entries, *to = malloc(sizeof(history_entry) * n);
+    history_entry *spare = to;
+    for (int shift = 0; shift < 64; shift += 8) { //least significant byte first, each pass is stable
+	int counts[257] = {0};
+	for (int i = 0; i < n; ++i) ++counts[((from[i].key >> shift) & 0xFF) + 1];
+	if (counts[((from[0].key >> shift) & 0xFF) + 1] == n) continue; //every key has the same byte here
+	for (int b = 0; b < 256; ++b) counts[b + 1] += counts[b];
+	for (int i = 0; i < n; ++i) to[counts[(from[i].key >> shift) & 0xFF]++] = from[i];
+	history_entry *t = from;
+	from = to;
+	to = t;
+    }
+    if (from != entries) memcpy(entries, from, sizeof(history_entry) * n);
+    free(spare);
+
+    for (int start = 0, end; start < n; start = end) {
+	unsigned longest = entries[start].len;
+	for (end = start + 1; (end < n) && (entries[end].key == entries[start].key); ++end) {
+	    if (entries[end].len > longest) longest = entries[end].len;
+	}
+	if ((end - start > 1) && (longest > 8 * (unsigned)depth + 8)) radix_sort_history(entries + start, end - start, depth + 1);
+    }
+
+    if (depth > 0) {
+	for (int i = 0; i < n; ++i) entries[i].key = history_key(&entries[i], 0);
+    }
+}
+
+/*
+ * sort_history
+ *
+ * Adds the entries indexed since the last call to history.sorted: only the new entries are sorted,
+ * then merged in, keeping the most recent entry of each command. Starts a background compaction
+ * once most of the log is duplicates.
+ */
+void sort_history() {
+    int n = history.count - history.sorted_upto;
+    if (n == 0) return;
+
+    history_entry *fresh = malloc(sizeof(history_entry) * n);
+    memcpy(fresh, history.entries + history.sorted_upto, sizeof(history_entry) * n);
+    radix_sort_history(fresh, n, 0);
+
+    history_entry *merged = malloc(sizeof(history_entry) * (history.num_sorted + n));
+    int i = 0, j = 0, m = 0;
+    while ((i < history.num_sorted) || (j < n)) {
+	history_entry next = ((j == n) || ((i < history.num_sorted) && (compare_history(&history.sorted[i], &fresh[j]) < 0))) ?
+	    history.sorted[i++] : fresh[j++];
+	//equal commands are adjacent and ordered by age, so the last one seen is the most recent
+	if ((m > 0) && (merged[m - 1].len == next.len) &&
+	    !memcmp(history.map + merged[m - 1].offset, history.map + next.offset, next.len)) merged[m - 1] = next;
+	else merged[m++] = next;
+    }
+
+    free(fresh);
+    free(history.sorted);
+    history.sorted = merged;
+    history.num_sorted = m;
+    history.sorted_upto = history.count;
+
+    if ((history.count >= HISTORY_COMPACT_MIN) && (history.count > 2 * history.num_sorted)) compact_history();
+}
+
+/*
+ * search_history
+ *
+ * Binary searches history.sorted for the commands starting with the len bytes of prefix, which are
+ * next to each other. If first and last are not NULL they receive the range of matches.
+ * Returns the most recent match, or NULL if there is none.
+ */
+const history_entry* search_history(const char *prefix, const size_t len, int *first, int *last) {
+    int bounds[2];
+    for (int upper = 0; upper < 2; ++upper) {
+	//lower bound: first entry not below prefix; upper bound: first entry past the ones starting with it
+	int lo = 0, hi = history.num_sorted;
+	while (lo < hi) {
+	    int mid = lo + (hi - lo) / 2;
+	    const history_entry *e = &history.sorted[mid];
+	    int r = memcmp(history.map + e -> offset, prefix, (e -> len < len) ? e -> len : len);
+	    if ((r == 0) && (e -> len < len)) r = -1;
+	    if ((r < 0) || (upper && (r == 0))) lo = mid + 1;
+	    else hi = mid;
+	}
+	bounds[upper] = lo;
+    }
+    if (first != NULL) *first = bounds[0];
+    if (last != NULL) *last = bounds[1];
+
+    const history_entry *recent = NULL;
+    for (int i = bounds[0]; i < bounds[1]; ++i) {
+	if ((recent == NULL) || (history.sorted[i].offset > recent -> offset)) recent = &history.sorted[i];
+    }
+    return recent;
+}
+
+/*
+ * compact_history
+ *
+ * Rewrites the log in a child process, keeping only the most recent entry of each command. Lines
+ * appended meanwhile are copied over under the log's flock before the new file is renamed over it.
+ * The child is reaped like any other; report_bg_process clears history.compactor.
+ */
+void compact_history() {
+    if ((history.compactor != 0) || (history.map == NULL) || (history.sorted_upto != history.count)) return;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0) {
+	if (pid > 0) history.compactor = pid;
+	return;
+    }
+
+    //child
+    history_entry *keep = malloc(sizeof(history_entry) * history.num_sorted);
+    memcpy(keep, history.sorted, sizeof(history_entry) * history.num_sorted);
+    qsort(keep, history.num_sorted, sizeof(history_entry), compare_history_age);
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, PATH_MAX, "%s.%d", history.path, getpid());
+    FILE *out = fopen(tmp, "we");
+    if (out == NULL) _exit(1);
+    for (int i = 0; i < history.num_sorted; ++i) {
+	fwrite(history.map + keep[i].offset, 1, keep[i].len, out);
+	fputc('\n', out);
+    }
+
+    struct stat st;
+    int fd = open(history.path, O_RDONLY | O_CLOEXEC);
+    if ((fd == -1) || (flock(fd, LOCK_EX) == -1) || (fstat(fd, &st) == -1) || (st.st_ino != history.inode)) {
+	unlink(tmp); //the log changed under us, leave it to the next compaction
+	_exit(1);
+    }
+    char buf[1 << 16];
+    ssize_t n;
+    for (off_t pos = history.indexed; (n = pread(fd, buf, sizeof(buf), pos)) > 0; pos += n) fwrite(buf, 1, n, out);
+
+    if ((fflush(out) != 0) || (fsync(fileno(out)) == -1) || (rename(tmp, history.path) == -1)) {
+	unlink(tmp);
+	_exit(1);
+    }
+    _exit(0); //the lock goes with the process
+}
+
+/*
+ * history_command
+ *
+ * Handles the history builtin:
+ * history [N] lists the last N (by default HISTORY_SHOW) commands with their numbers,
+ * history -s prefix lists the most recent distinct commands starting with prefix, newest first, and
+ * history -c compacts the log in the background.
+ */
+void history_command(char **args) {
+    if (load_history() == -1) {
+	fprintf(stderr, "ssi: history: no history file\n");
+	return;
+    }
+
+    if ((args[1] == NULL) || ((args[1][0] >= '0') && (args[1][0] <= '9'))) {
+	int n = (args[1] != NULL) ? atoi(args[1]) : HISTORY_SHOW;
+	for (int i = (n < history.count) ? history.count - n : 0; i < history.count; ++i) {
+	    printf("%6d  %.*s\n", i + 1, history.entries[i].len, history.map + history.entries[i].offset);
+	}
+    }
+    else if (!strcmp(args[1], "-s") && (args[2] != NULL)) {
+	//the prefix is the rest of the line, with the args joined by single spaces
+	char prefix[ARG_MAX];
+	char *c = prefix;
+	for (int i = 2; args[i] != NULL; ++i) c += snprintf(c, prefix + ARG_MAX - c, (i > 2) ? " %s" : "%s", args[i]);
+
+	int first, last;
+	sort_history();
+	search_history(prefix, c - prefix, &first, &last);
+
+	history_entry *matches = malloc(sizeof(history_entry) * (last - first + 1));
+	memcpy(matches, history.sorted + first, sizeof(history_entry) * (last - first));
+	qsort(matches, last - first, sizeof(history_entry), compare_history_age);
+	for (int i = last - first - 1; (i >= 0) && (i >= last - first - HISTORY_SHOW); --i) {
+	    printf("%.*s\n", matches[i].len, history.map + matches[i].offset);
+	}
+	free(matches);
+    }
+    else if (!strcmp(args[1], "-c")) {
+	sort_history();
+	if (history.count == history.num_sorted) printf("history: nothing to compact\n");
+	else {
+	    compact_history();
+	    printf("history: compacting %d entries to %d in the background\n", history.count, history.num_sorted);
+	}
+    }
+    else fprintf(stderr, "ssi: history: usage: history [N] | history -s prefix | history -c\n");
+}
+
+/*
+ * expand_history
+ *
+ * Replaces an input line of the form !prefix with the most recent command starting with prefix,
+ * and !! with the last command, echoing the result like bash does. Other lines are left alone.
+ * Returns -1 (after printing an error) if there is no such command, 0 otherwise.
+ */
+int expand_history(char *input, const int inputsize) {
+    if ((input[0] != '!') || (input[1] == '\0')) return 0;
+
+    const history_entry *entry = NULL;
+    if (load_history() == 0) {
+	if (!strcmp(input, "!!")) entry = (history.count > 0) ? &history.entries[history.count - 1] : NULL;
+	else {
+	    sort_history();
+	    entry = search_history(input + 1, strlen(input + 1), NULL, NULL);
+	}
+    }
+    if ((entry == NULL) || (entry -> len >= (unsigned)inputsize)) {
+	fprintf(stderr, "ssi: %s: event not found\n", input);
+	return -1;
+    }
+
+    memcpy(input, history.map + entry -> offset, entry -> len);
+    input[entry -> len] = '\0';
+    printf("%s\n", input);
+    return 0;
+}
+
+/*
+ * find_pool
+ *
+ * Returns the worker pool called name, or NULL.
+ */
+worker_pool* find_pool(const bg_process_list *bg_list, const char *name) {
+    worker_pool *pool;
+    for (pool = bg_list -> pools; (pool != NULL) && strcmp(pool -> name, name); pool = pool -> next);
+    return pool;
+}
+
+/*
+ * start_pool_worker
+ *
+ * Starts a worker of pool, in the pool's directory, and adds it to the idle workers. In the
+ * interactive shell it gets a process group of its own, so a ^C at the prompt does not reach it.
+ * Returns 0 on success, -1 if the command could not be started.
+ */
+int start_pool_worker(worker_pool *pool) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+	fprintf(stderr, "ssi: pool: error creating pipe: %s\n", strerror(errno));
+	return -1;
+    }
+
+    pid_t pid = launch_process(pool -> args, fds[0], -1, -1, (event_fd == -1) ? -1 : 0, 0, NULL, pool -> path);
+    close(fds[0]);
+    if (pid <= 0) {
+	close(fds[1]);
+	return -1;
+    }
+
+    pool -> idle[pool -> num_idle].pid = pid;
+    pool -> idle[pool -> num_idle].request_fd = fds[1];
+    ++pool -> num_idle;
+    return 0;
+}
+
+/*
+ * create_pool
+ *
+ * Handles "pool create name N cmd": creates a pool of N workers running cmd in the directory path.
+ * cmd is a single command, as its stdin is the pipe requests arrive on.
+ */
+void create_pool(bg_process_list *bg_list, const char *path, char **args) {
+    int size = ((args[2] != NULL) && (args[3] != NULL)) ? atoi(args[3]) : 0;
+    char **cmd = (size > 0) ? args + 4 : NULL;
+    if ((cmd == NULL) || (cmd[0] == NULL) || (size > POOL_MAX_WORKERS)) {
+	fprintf(stderr, "ssi: pool: usage: pool create name N cmd, with N from 1 to %d\n", POOL_MAX_WORKERS);
+	return;
+    }
+    if (find_pool(bg_list, args[2]) != NULL) {
+	fprintf(stderr, "ssi: pool: %s: pool already exists\n", args[2]);
+	return;
+    }
+    for (int i = 0; cmd[i] != NULL; ++i) {
+	if (!strcmp(cmd[i], "|") || !strcmp(cmd[i], "<") || !strcmp(cmd[i], ">") || !strcmp(cmd[i], ">>")) {
+	    fprintf(stderr, "ssi: pool: error, pipelines and redirections cannot be pooled\n");
+	    return;
+	}
+    }
+
+    //the struct, the idle workers, the argv array, name, path and every arg share one allocation
+    int argc;
+    size_t text = strlen(args[2]) + strlen(path) + 2;
+    for (argc = 0; cmd[argc] != NULL; ++argc) text += strlen(cmd[argc]) + 1;
+
+    worker_pool *pool = malloc(sizeof(worker_pool) + sizeof(pool_worker) * size + sizeof(char*) * (argc + 1) + text);
+    pool -> idle = (pool_worker*)(pool + 1);
+    pool -> args = (char**)(pool -> idle + size);
+    char *c = (char*)(pool -> args + argc + 1);
+    pool -> name = c;
+    c = stpcpy(c, args[2]) + 1;
+    pool -> path = c;
+    c = stpcpy(c, path) + 1;
+    for (int i = 0; i < argc; ++i) {
+	pool -> args[i] = c;
+	c = stpcpy(c, cmd[i]) + 1;
+    }
+    pool -> args[argc] = NULL;
+    pool -> size = size;
+    pool -> num_idle = 0;
+    pool -> runs = 0;
+    pool -> cold = 0;
+    pool -> lost = 0;
+
+    while ((pool -> num_idle < size) && (start_pool_worker(pool) == 0));
+    if (pool -> num_idle == 0) {
+	free(pool);
+	return;
+    }
+    pool -> next = bg_list -> pools;
+    bg_list -> pools = pool;
+    last_status = 0;
+}
+
+/*
+ * run_pool
+ *
+ * Handles "pool run name args": gives args to the oldest idle worker of the pool, which is then
+ * run like a foreground command, and starts a replacement worker while it runs. A worker is only
+ * started on demand when none is idle, which the pool's statistics count as a cold run.
+ * The request is written with SIGPIPE blocked, so a worker that has exited is found by EPIPE and
+ * passed over instead of killing the shell.
+ */
+void run_pool(bg_process_list *bg_list, char **args) {
+    worker_pool *pool = (args[2] != NULL) ? find_pool(bg_list, args[2]) : NULL;
+    if (pool == NULL) {
+	if (args[2] == NULL) fprintf(stderr, "ssi: pool: usage: pool run name args\n");
+	else fprintf(stderr, "ssi: pool: %s: no such pool\n", args[2]);
+	return;
+    }
+
+    char request[ARG_MAX + 1];
+    size_t len = 0;
+    for (int i = 3; (args[i] != NULL) && (len < ARG_MAX); ++i)
+	len += snprintf(request + len, ARG_MAX + 1 - len, (i > 3) ? " %s" : "%s", args[i]);
+    if (len > ARG_MAX - 1) len = ARG_MAX - 1;
+    request[len++] = '\n'; //at most ARG_MAX bytes, less than PIPE_BUF, so written at once
+
+    sigset_t pipe_mask, old_mask;
+    sigemptyset(&pipe_mask);
+    sigaddset(&pipe_mask, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipe_mask, &old_mask);
+
+    pool_worker worker = { -1, -1 };
+    while (worker.pid == -1) {
+	if (pool -> num_idle == 0) {
+	    if (start_pool_worker(pool) == -1) break;
+	    ++pool -> cold;
+	}
+	worker = pool -> idle[0];
+	memmove(pool -> idle, pool -> idle + 1, sizeof(pool_worker) * --pool -> num_idle);
+
+	if ((shell_terminal != -1) && (event_fd != -1)) tcsetpgrp(shell_terminal, worker.pid);
+	ssize_t n;
+	while (((n = write(worker.request_fd, request, len)) == -1) && (errno == EINTR));
+	close(worker.request_fd);
+	if (n != (ssize_t)len) { //the worker has gone, it is reaped like any unknown child
+	    struct timespec zero = { 0, 0 };
+	    sigtimedwait(&pipe_mask, NULL, &zero);
+	    ++pool -> lost;
+	    worker.pid = -1;
+	}
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    if (worker.pid == -1) {
+	reclaim_terminal();
+	last_status = 127;
+	return;
+    }
+    ++pool -> runs;
+
+    while ((pool -> num_idle < pool -> size) && (start_pool_worker(pool) == 0));
+
+    int status;
+    while ((waitpid(worker.pid, &status, WUNTRACED) == -1) && (errno == EINTR));
+    reclaim_terminal();
+    if (WIFSTOPPED(status)) {
+	stop_foreground(bg_list, pool -> path, args, worker.pid, (event_fd != -1) ? worker.pid : 0);
+	last_status = 128 + WSTOPSIG(status);
+	return;
+    }
+    last_status = exit_status(status);
+    if (last_status == 128 + SIGINT) printf("\n"); //the prompt goes below the ^C
+    drain_sigint();
+}
+
+/*
+ * destroy_pool
+ *
+ * Sends SIGTERM to the idle workers of pool, closes their request pipes and frees the pool.
+ * The workers are reaped like any other child.
+ */
+void destroy_pool(bg_process_list *bg_list, worker_pool *pool) {
+    worker_pool **link = &bg_list -> pools;
+    while (*link != pool) link = &(*link) -> next;
+    *link = pool -> next;
+
+    for (int i = 0; i < pool -> num_idle; ++i) {
+	kill(pool -> idle[i].pid, SIGTERM);
+	close(pool -> idle[i].request_fd);
+    }
+    free(pool); //the workers, args and names are part of the same allocation
+}
+
+/*
+ * forget_pool_worker
+ *
+ * Called when a child that is not a background process has been reaped. If it was an idle pool
+ * worker it is dropped from its pool; it is not replaced, so a command that does not wait for
+ * its request cannot keep the shell starting new workers.
+ */
+void forget_pool_worker(bg_process_list *bg_list, const pid_t pid) {
+    for (worker_pool *pool = bg_list -> pools; pool != NULL; pool = pool -> next) {
+	for (int i = 0; i < pool -> num_idle; ++i) {
+	    if (pool -> idle[i].pid != pid) continue;
+	    close(pool -> idle[i].request_fd);
+	    memmove(pool -> idle + i, pool -> idle + i + 1, sizeof(pool_worker) * (--pool -> num_idle - i));
+	    ++pool -> lost;
+	    return;
+	}
+    }
+}
+
+/*
+ * print_pools
+ *
+ * Prints every worker pool with its command and statistics, for bglist.
+ */
+void print_pools(const bg_process_list *bg_list) {
+    for (worker_pool *pool = bg_list -> pools; pool != NULL; pool = pool -> next) {
+	printf("pool %s: %s/", pool -> name, pool -> path);
+	for (int i = 0; pool -> args[i] != NULL; ++i) printf("%s ", pool -> args[i]);
+	printf("(%d of %d idle, %d runs, %d cold, %d lost)\n", pool -> num_idle, pool -> size,
+	       pool -> runs, pool -> cold, pool -> lost);
+    }
+}
+
+/*
+ * is_tracked_child
+ *
+ * Returns 1 if the child pid (in process group pgid) belongs to a background job, as its tracked
+ * pid or another stage of its group, or is an idle pool worker.
+ */
+int is_tracked_child(const bg_process_list *bg_list, const pid_t pid, const pid_t pgid) {
+    if (find_bg_process(bg_list, pid) != NULL) return 1;
+    for (bg_process *temp = bg_list -> head; temp != NULL; temp = temp -> next)
+	if ((temp -> pgid > 0) && (temp -> pgid == pgid)) return 1;
+    for (worker_pool *pool = bg_list -> pools; pool != NULL; pool = pool -> next)
+	for (int i = 0; i < pool -> num_idle; ++i)
+	    if (pool -> idle[i].pid == pid) return 1;
+    return 0;
+}
+
+/*
+ * check_bg_list
+ *
+ * Handles "bglist -c": reaps the children that have already exited, then checks that the job
+ * list, its pid hash table and its counters agree, that every job is still a child, and (from
+ * /proc) that every child of the shell belongs to a job or a pool. A job may exit during the
+ * check; it is counted as exiting, since its exit notice is still to be read, but an untracked
+ * zombie would never be reported and is a problem. Each problem is printed, followed by a
+ * summary. Returns the number of problems found.
+ */
+int check_bg_list(bg_process_list *bg_list) {
+    int problems = 0;
+    check_bg_process_list(bg_list, 0);
+
+    int listed = 0, terminating = 0;
+    for (bg_process *temp = bg_list -> head; temp != NULL; temp = temp -> next) {
+	++listed;
+	if ((temp -> next == NULL) ? (bg_list -> tail != temp) : (temp -> next -> prev != temp)) {
+	    fprintf(stderr, "ssi: bglist: %d: broken list links\n", temp -> pid);
+	    ++problems;
+	}
+	if (find_bg_process(bg_list, temp -> pid) != temp) {
+	    fprintf(stderr, "ssi: bglist: %d: not in its hash bucket\n", temp -> pid);
+	    ++problems;
+	}
+	if (temp -> kill_signal == SIGTERM) ++terminating;
+	if ((kill(temp -> pid, 0) == -1) && (errno == ESRCH)) {
+	    fprintf(stderr, "ssi: bglist: %d: listed but no longer exists\n", temp -> pid);
+	    ++problems;
+	}
+    }
+    if ((bg_list -> head != NULL) && (bg_list -> head -> prev != NULL)) {
+	fprintf(stderr, "ssi: bglist: broken list head\n");
+	++problems;
+    }
+
+    int hashed = 0;
+    for (int b = 0; b < bg_list -> num_buckets; ++b)
+	for (bg_process *temp = bg_list -> buckets[b]; temp != NULL; temp = temp -> hash_next) {
+	    ++hashed;
+	    if (bg_bucket(bg_list, temp -> pid) != (unsigned)b) {
+		fprintf(stderr, "ssi: bglist: %d: in the wrong hash bucket\n", temp -> pid);
+		++problems;
+	    }
+	}
+
+    int queued = 0, finished = 0;
+    for (bg_process *temp = bg_list -> queue_head; temp != NULL; temp = temp -> next) ++queued;
+    for (bg_process *temp = bg_list -> finished; temp != NULL; temp = temp -> next) ++finished;
+
+    const struct { const char *name; int counted, expected; } counters[] = {
+	{"jobs listed", listed, bg_list -> count},
+	{"jobs hashed", hashed, bg_list -> count},
+	{"jobs terminating", terminating, bg_list -> terminating},
+	{"jobs queued", queued, bg_list -> queued},
+	{"finished jobs kept", finished, bg_list -> num_finished}
+    };
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); ++i)
+	if (counters[i].counted != counters[i].expected) {
+	    fprintf(stderr, "ssi: bglist: %s: counted %d, expected %d\n", counters[i].name,
+		    counters[i].counted, counters[i].expected);
+	    ++problems;
+	}
+
+    int children = 0, exiting = 0;
+    DIR *proc = opendir("/proc");
+    if (proc == NULL) {
+	fprintf(stderr, "ssi: bglist: /proc: %s\n", strerror(errno));
+	++problems;
+    }
+    for (struct dirent *entry; (proc != NULL) && ((entry = readdir(proc)) != NULL); ) {
+	if (!isdigit((unsigned char)entry -> d_name[0])) continue;
+	pid_t pid = atoi(entry -> d_name);
+	char stat_path[64], stat[512];
+	snprintf(stat_path, sizeof(stat_path), "/proc/%d/stat", pid);
+	int fd = open(stat_path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) continue; //already gone
+	ssize_t n = read(fd, stat, sizeof(stat) - 1);
+	close(fd);
+	if (n <= 0) continue;
+	stat[n] = '\0';
+
+	//pid (comm) state ppid pgrp, comm may itself contain ')'
+	char *c = strrchr(stat, ')'), state;
+	int ppid, pgid;
+	if ((c == NULL) || (sscanf(c + 1, " %c %d %d", &state, &ppid, &pgid) != 3) || (ppid != getpid())) continue;
+	++children;
+	if (is_tracked_child(bg_list, pid, pgid)) {
+	    if (state == 'Z') ++exiting; //exited since the reap above, its notice is still to come
+	}
+	else {
+	    fprintf(stderr, "ssi: bglist: %d: untracked %s\n", pid, (state == 'Z') ? "zombie" : "child");
+	    ++problems;
+	}
+    }
+    if (proc != NULL) closedir(proc);
+
+    printf("bglist: %s, %d jobs, %d queued, %d buckets, %d child processes (%d exiting)\n",
+	   (problems == 0) ? "consistent" : "INCONSISTENT", bg_list -> count, bg_list -> queued,
+	   bg_list -> num_buckets, children, exiting);
+    return problems;
+}
+
+/*
+ * pool_command
+ *
+ * Handles the pool builtin: "pool create name N cmd", "pool run name args" and "pool destroy name".
+ * last_status is 0 if the command succeeded; for pool run it is the exit status of the worker.
+ */
+void pool_command(bg_process_list *bg_list, const char *path, char **args) {
+    last_status = 2;
+    if ((args[1] != NULL) && !strcmp(args[1], "create")) create_pool(bg_list, path, args);
+    else if ((args[1] != NULL) && !strcmp(args[1], "run")) run_pool(bg_list, args);
+    else if ((args[1] != NULL) && !strcmp(args[1], "destroy") && (args[2] != NULL)) {
+	worker_pool *pool = find_pool(bg_list, args[2]);
+	if (pool == NULL) fprintf(stderr, "ssi: pool: %s: no such pool\n", args[2]);
+	else {
+	    destroy_pool(bg_list, pool);
+	    last_status = 0;
+	}
+    }
+    else fprintf(stderr, "ssi: pool: usage: pool create name N cmd | pool run name args | pool destroy name\n");
+}
+
+/*
+ * is_builtin
+ *
+ * Returns 1 if args is one of the commands handled by ssi itself rather than an external program.
+ */
+int is_builtin(char **args) {
+    const char *builtins[] = {"exit", "cd", "bglist", "kill", "bg", "fg", "stop", "cont", "hash", "bgout", "bench", "history",
+			      "pool", NULL};
+    for (int i = 0; builtins[i] != NULL; ++i) {
+	if (!strcmp(args[0], builtins[i])) return 1;
+    }
+    return 0;
+}
+
+/*
+ * execute
+ *
+ * Handles the ssi command specified in the input string.
+ * Special commands include exit, which terminates the program,
  * cd, which calls the change_directory funtion to modify the input variable path
- * bglist, which lists the ongoing background processes, and
- * bg cmd, which will execute the command specified by cmd in the background.
- * Otherwise, execute will attempt to exec the command specified in the input.
+ * bglist, which lists the ongoing background processes, and bglist -c, which checks the job table for consistency,
+ * kill pid, which terminates a background process,
+ * fg [pid], which moves a background process to the foreground,
+ * stop [pid] and cont [pid], which stop a background process and resume it in the background,
+ * hash, which shows or clears the cache of command locations,
+ * bgout pid, which shows the captured output of a background process,
+ * bench N [-j K] cmd, which times N runs of cmd, K at a time,
+ * history, which lists, searches or compacts the command history,
+ * pool create|run|destroy, which manages pools of workers started ahead of time,
+ * bg -j N, which limits the number of background processes running at once,
+ * bg, which resumes the most recently stopped process in the background, and
+ * bg [--cpus=LIST] [--mem=SIZE] [--nice=N] [--cgroup=DIR] [--capture] [--spill=FILE] cmd, which will execute the command
+ * specified by cmd in the background, with the given limits.
+ * Otherwise, execute will attempt to exec the command specified in the input. In the interactive
+ * shell it runs in a process group of its own that is given the terminal, and if it is stopped
+ * (with ^Z) it becomes a stopped background process.
  */
 int execute(char **args, char *path, bg_process_list *bg_list) {
     if (args[0] == NULL) return 0;
@@ -355,35 +4454,267 @@ int execute(char **args, char *path, bg_process_list *bg_list) {
 	change_directory(path, args);	
     }    
     else if (!strcmp(args[0], "bglist")) {
+	if ((args[1] != NULL) && !strcmp(args[1], "-c")) {
+	    last_status = (check_bg_list(bg_list) == 0) ? 0 : 1;
+	    return 0;
+	}
 	print_bg_list(bg_list);
     }
     else if (!strcmp(args[0], "kill")) {
 	kill_process(bg_list, args);
     }
+    else if (!strcmp(args[0], "fg")) {
+	foreground_process(bg_list, args);
+	return 0; //fg sets last_status
+    }
+    else if (!strcmp(args[0], "stop")) {
+	stop_process(bg_list, args);
+    }
+    else if (!strcmp(args[0], "cont")) {
+	continue_process(bg_list, args);
+    }
+    else if (!strcmp(args[0], "hash")) {
+	hash_command(args);
+    }
+    else if (!strcmp(args[0], "bgout")) {
+	print_bg_output(bg_list, args);
+    }
+    else if (!strcmp(args[0], "history")) {
+	history_command(args);
+    }
+    else if (!strcmp(args[0], "bench")) {
+	bench_command(args, bg_list);
+	return 0; //bench sets last_status
+    }
+    else if (!strcmp(args[0], "pool")) {
+	pool_command(bg_list, path, args);
+	return 0; //pool sets last_status
+    }
     else {
-	int bg = 0;
-	pid_t pid = fork();
-	
 	if (!strcmp(args[0], "bg")) {	    
-	    bg = 1;
-	    ++args; //args[0] is now args[1] to avoid the leading "bg"
-	    //	    input_cpy += 3;
+	    if (args[1] == NULL) {
+		continue_process(bg_list, args);
+		last_status = 0;
+		return 0;
+	    }
+	    if (!strcmp(args[1], "-j")) {
+		set_bg_job_slots(bg_list, args + 1);
+		last_status = 0;
+		return 0;
+	    }
+	    pid_t pid;
+	    last_status = submit_bg_process(bg_list, path, args + 1, &pid); //skip the leading "bg"
+	    return 0;
 	}
-	
-	if (pid < 0) {
-	    fprintf(stderr, "ssi: execute: error fork failed\n");
-	    exit(1);
-	}	    
-	else if (pid == 0) { //child
-	    if(execvp(args[0], args) == -1) fprintf(stderr, "ssi: execute: error execvp failed\n");
-	    exit(1);
+
+	//if not bg wait for the stages of this pipeline only, background children are left to check_bg_process_list
+	int stages = count_stages(args);
+	pid_t *pids = malloc(sizeof(pid_t) * stages);
+	pid_t pgid;
+	launch_pipeline(args, pids, NULL, NULL, NULL, GROUP_FOREGROUND, &pgid);
+
+	last_status = 127;
+	for (int i = 0; i < stages; ++i) {
+	    if (pids[i] <= 0) continue;
+	    int status;
+	    while ((waitpid(pids[i], &status, WUNTRACED) == -1) && (errno == EINTR));
+	    if (WIFSTOPPED(status)) {
+		//the stages still running are stopped with it and reaped like those of a background job
+		reclaim_terminal();
+		if (pids[stages - 1] > 0) stop_foreground(bg_list, path, args, pids[stages - 1], pgid);
+		last_status = 128 + WSTOPSIG(status);
+		free(pids);
+		return 0;
+	    }
+	    if (i == stages - 1) last_status = exit_status(status);
 	}
-	else { //parent
-	    if (bg) insert_bg_process(bg_list, pid, path, args);
-	    else wait(NULL); //if not bg wait for child process termination
-	}	
+	reclaim_terminal();
+	free(pids);
+	if (last_status == 128 + SIGINT) printf("\n"); //the prompt goes below the ^C
+	drain_sigint();
+	return 0;
     }
 
+    last_status = 0;
     return 0;
 }
 
+/*
+ * script_reap
+ *
+ * Reaps terminated children while a script runs. Commands started concurrently by run_script are
+ * removed from running and their exit status reported; background processes are reported as usual.
+ * If block is set, waits until at least one script command has finished.
+ * Without an event loop, killed jobs whose time is up are sent SIGKILL here.
+ * Returns the exit status of the last script command reaped, or -1 if none was.
+ */
+int script_reap(script_job *running, int *num_running, const char *name, bg_process_list *bg_list, const int block) {
+    int result = -1;
+    escalate_kills(bg_list);
+
+    for (;;) {
+	int status;
+	struct rusage usage;
+	pid_t pid = wait4(-1, &status, (block && (result == -1)) ? 0 : WNOHANG, &usage);
+	if (pid == 0) break;
+	if (pid == -1) {
+	    if (errno == EINTR) continue;
+	    break;
+	}
+
+	int i;
+	for (i = 0; (i < *num_running) && (running[i].pid != pid); ++i);
+	if (i < *num_running) {
+	    result = exit_status(status);
+	    fprintf(stderr, "ssi: %s:%d: exit %d\n", name, running[i].line, result);
+	    running[i] = running[--*num_running];
+	}
+	else report_bg_process(bg_list, pid, status, &usage, 0);
+    }
+    return result;
+}
+
+/*
+ * drain_bg_queue
+ *
+ * Called at the end of a script: waits for background processes to terminate until every command
+ * still in the run queue has been started, so none of them is dropped when the shell exits. Killed
+ * jobs are still sent SIGKILL when their time is up.
+ */
+void drain_bg_queue(bg_process_list *bg_list) {
+    while (bg_list -> queued > 0) {
+	escalate_kills(bg_list);
+	int status;
+	struct rusage usage;
+	pid_t pid = wait4(-1, &status, (bg_list -> terminating > 0) ? WNOHANG : 0, &usage);
+	if (pid == 0) {
+	    struct timespec tick = { 0, 10000000 };
+	    nanosleep(&tick, NULL);
+	    continue;
+	}
+	if (pid == -1) {
+	    if (errno == EINTR) continue;
+	    fprintf(stderr, "ssi: bg: %d queued commands could not be started\n", bg_list -> queued);
+	    break;
+	}
+	report_bg_process(bg_list, pid, status, &usage, 0); //which starts the next queued commands
+    }
+}
+
+/*
+ * run_script
+ *
+ * Runs each line of script as if it had been typed at the prompt, without printing the prompt,
+ * and reports the exit status of every command on stderr as "ssi: name:line: exit status".
+ * Lines starting with # are comments.
+ * With max_jobs above one, consecutive external commands run concurrently with at most max_jobs
+ * at a time, like xargs -P. Builtins act as barriers: all running commands finish before a
+ * builtin runs, so cd, kill and bglist see the same state as in a sequential run.
+ * Background commands still queued for a job slot at the end are started before it returns.
+ * Returns the exit status of the last command that finished.
+ */
+int run_script(const char *script, const size_t length, const char *name, const int max_jobs,
+	       char *path, bg_process_list *bg_list, arena *mem) {
+    script_job *running = malloc(sizeof(script_job) * max_jobs);
+    int num_running = 0;
+    int status = 0;
+    int line = 0;
+
+    const char *end = script + length;
+    for (const char *start = script; start < end; ) {
+	const char *newline = memchr(start, '\n', end - start);
+	size_t len = (newline != NULL) ? (size_t)(newline - start) : (size_t)(end - start);
+	const char *next = start + len + 1;
+	++line;
+
+	if (len >= ARG_MAX) {
+	    fprintf(stderr, "ssi: %s:%d: error, line longer than %d characters\n", name, line, ARG_MAX - 1);
+	    status = 1;
+	    start = next;
+	    continue;
+	}
+	reset_arena(mem);
+	char *user_args = arena_alloc(mem, len + 1);
+	memcpy(user_args, start, len);
+	user_args[len] = '\0';
+	start = next;
+
+	char **args = parse_input(user_args, mem);
+	int done = 0;
+
+	if ((args[0] != NULL) && (args[0][0] != '#')) {
+	    if ((max_jobs > 1) && !is_builtin(args)) {
+		while (num_running == max_jobs) {
+		    int s = script_reap(running, &num_running, name, bg_list, 1);
+		    if (s != -1) status = s;
+		}
+		pid_t pid = launch_pipeline(args, NULL, NULL, NULL, NULL, GROUP_SHELL, NULL);
+		if (pid > 0) {
+		    running[num_running].pid = pid;
+		    running[num_running].line = line;
+		    ++num_running;
+		}
+		else {
+		    status = 127;
+		    fprintf(stderr, "ssi: %s:%d: exit %d\n", name, line, status);
+		}
+	    }
+	    else {
+		while (num_running > 0) {
+		    int s = script_reap(running, &num_running, name, bg_list, 1);
+		    if (s != -1) status = s;
+		}
+		done = execute(args, path, bg_list);
+		status = last_status;
+		fprintf(stderr, "ssi: %s:%d: exit %d\n", name, line, status);
+	    }
+	}
+
+	if (done) break;
+
+	int s = script_reap(running, &num_running, name, bg_list, 0);
+	if (s != -1) status = s;
+    }
+
+    while (num_running > 0) {
+	int s = script_reap(running, &num_running, name, bg_list, 1);
+	if (s != -1) status = s;
+    }
+    drain_bg_queue(bg_list);
+    fflush(stdout);
+
+    free(running);
+    return status;
+}
+
+/*
+ * run_script_file
+ *
+ * Maps filename into memory and runs it with run_script, so large scripts are read without copying.
+ */
+int run_script_file(const char *filename, const int max_jobs, char *path, bg_process_list *bg_list, arena *mem) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if ((fd == -1) || (fstat(fd, &st) == -1)) {
+	fprintf(stderr, "ssi: %s: %s\n", filename, strerror(errno));
+	if (fd != -1) close(fd);
+	return 127;
+    }
+    if (st.st_size == 0) {
+	close(fd);
+	return 0;
+    }
+
+    char *script = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (script == MAP_FAILED) {
+	fprintf(stderr, "ssi: %s: error mapping file: %s\n", filename, strerror(errno));
+	return 127;
+    }
+    madvise(script, st.st_size, MADV_SEQUENTIAL);
+
+    int status = run_script(script, st.st_size, filename, max_jobs, path, bg_list, mem);
+    munmap(script, st.st_size);
+    return status;
+}
+
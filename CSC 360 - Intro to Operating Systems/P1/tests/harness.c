@@ -0,0 +1,564 @@
+/*
+ *  CSC360 Assignment 1 - test harness
+ *  Drives ssi through a pseudo-terminal, as a user at the prompt would, and checks the job table
+ *  under load: a storm of short background jobs and a soak of kills racing jobs that exit. It
+ *  also checks that the pipes of a captured job are drained and closed after the job was reaped,
+ *  and that a command which moved to another PATH directory is still found when forking.
+ *  Every check prints its numbers; the harness exits with 1 if any of them failed.
+ *
+ *  The bench mode times commands at the prompt and the spawning and reaping of background jobs.
+ *
+ *  usage: harness test|bench SSI [SSI options]
+ */
+
+#define _GNU_SOURCE //cfmakeraw
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <time.h>
+#include <dirent.h>
+#include <termios.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MARK "harness-sync" //value of $SSI_MARK in the shell, the output of "echo $SSI_MARK-N"
+#define TIMEOUT 60 //seconds to wait for one batch of commands
+#define BATCH 100 //commands written before waiting for the shell to catch up
+#define STORM_JOBS 10000
+#define SOAK_ROUNDS 50
+#define CPS_COMMANDS 2000
+#define ORPHAN_SECONDS 1 //how long the grandchild of a captured job keeps its pipes open
+
+typedef struct session {
+    pid_t pid; //the shell
+    int fd; //master side of its terminal
+    int marks; //sync markers sent so far
+    char *output; //everything the shell printed since the last marker
+    size_t len;
+    size_t size;
+} session;
+
+int failures = 0;
+
+void start_session(session *s, char **argv);
+void end_session(session *s);
+double now();
+int run(session *s, const char *commands);
+void run_repeated(session *s, const char *command, const int count);
+void count_children(const pid_t parent, int *children, int *zombies);
+void scan_children(const pid_t parent, int *children, int *zombies);
+long cpu_ticks(const pid_t pid);
+int count_fds(const pid_t pid);
+int check_jobs(session *s, int *jobs);
+int wait_for_jobs(session *s, const double timeout);
+void check(const int ok, const char *what);
+void commands_per_second(session *s);
+void spawn_storm(session *s);
+void spawn_reap(session *s);
+void kill_soak(session *s);
+void orphaned_capture(session *s);
+void moved_command(char **argv);
+
+int main(int argc, char **argv) {
+    if ((argc < 3) || (strcmp(argv[1], "test") && strcmp(argv[1], "bench"))) {
+	fprintf(stderr, "usage: harness test|bench SSI [SSI options]\n");
+	return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    session s;
+    start_session(&s, argv + 2);
+    if (!strcmp(argv[1], "test")) {
+	spawn_storm(&s);
+	kill_soak(&s);
+	orphaned_capture(&s);
+    }
+    else {
+	commands_per_second(&s);
+	spawn_reap(&s);
+    }
+    end_session(&s);
+    if (!strcmp(argv[1], "test")) moved_command(argv + 2);
+
+    if (failures > 0) printf("harness: %d checks FAILED\n", failures);
+    return (failures > 0) ? 1 : 0;
+}
+
+/*
+ * start_session
+ *
+ * Starts the shell argv on a new pseudo-terminal with echo turned off, so the output holds only
+ * what the shell prints, and with its history in a file of its own. Waits for the first prompt.
+ */
+void start_session(session *s, char **argv) {
+    char history[64];
+    snprintf(history, sizeof(history), "/tmp/ssi-harness-%d", (int)getpid());
+    setenv("SSI_HISTORY", history, 1);
+    setenv("SSI_MARK", MARK, 1);
+
+    struct termios modes;
+    memset(&modes, 0, sizeof(modes));
+    cfmakeraw(&modes);
+    modes.c_iflag |= ICRNL;
+    modes.c_oflag |= OPOST | ONLCR;
+    modes.c_lflag |= ICANON | ISIG; //a line at a time, like a terminal, without ECHO
+    modes.c_cc[VINTR] = 3;
+    modes.c_cc[VEOF] = 4;
+    modes.c_cc[VSUSP] = 26;
+    modes.c_cc[VMIN] = 1;
+
+    s -> marks = 0;
+    s -> len = 0;
+    s -> size = 1 << 16;
+    s -> output = malloc(s -> size);
+    s -> pid = forkpty(&s -> fd, NULL, &modes, NULL);
+    if (s -> pid == -1) {
+	fprintf(stderr, "harness: forkpty: %s\n", strerror(errno));
+	exit(2);
+    }
+    if (s -> pid == 0) {
+	execv(argv[0], argv);
+	fprintf(stderr, "harness: %s: %s\n", argv[0], strerror(errno));
+	_exit(127);
+    }
+    fcntl(s -> fd, F_SETFL, O_NONBLOCK);
+    if (run(s, "") == -1) {
+	fprintf(stderr, "harness: %s did not start\n", argv[0]);
+	exit(2);
+    }
+}
+
+/*
+ * end_session
+ *
+ * Exits the shell and removes its history file.
+ */
+void end_session(session *s) {
+    run(s, "exit\n");
+    close(s -> fd);
+    int status;
+    waitpid(s -> pid, &status, 0);
+    unlink(getenv("SSI_HISTORY"));
+    free(s -> output);
+}
+
+/*
+ * now
+ *
+ * Returns the time in seconds on CLOCK_MONOTONIC.
+ */
+double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/*
+ * run
+ *
+ * Types commands, any number of lines, at the shell followed by "echo $SSI_MARK-N", and reads
+ * its output until that marker has been printed, so every command before it has been carried
+ * out. The output before the marker is left in s -> output. Input is written as the terminal
+ * accepts it while output is read, so neither side blocks on a full buffer.
+ * Returns 0, or -1 if the shell exited or did not print the marker within TIMEOUT seconds.
+ */
+int run(session *s, const char *commands) {
+    char marker[32], input[64];
+    int n = ++s -> marks;
+    snprintf(marker, sizeof(marker), MARK "-%d\r\n", n);
+    snprintf(input, sizeof(input), "echo $SSI_MARK-%d\n", n);
+
+    size_t total = strlen(commands) + strlen(input);
+    char *pending = malloc(total + 1);
+    sprintf(pending, "%s%s", commands, input);
+    size_t written = 0;
+    s -> len = 0;
+
+    double deadline = now() + TIMEOUT;
+    char *found = NULL;
+    while (found == NULL) {
+	double left = deadline - now();
+	if (left <= 0) break;
+	struct pollfd p = { .fd = s -> fd, .events = POLLIN | ((written < total) ? POLLOUT : 0) };
+	if (poll(&p, 1, (int)(left * 1000) + 1) <= 0) continue;
+
+	if ((p.revents & POLLOUT) && (written < total)) {
+	    ssize_t k = write(s -> fd, pending + written, total - written);
+	    if (k > 0) written += k;
+	}
+	if (p.revents & (POLLIN | POLLHUP)) {
+	    if (s -> len + 4096 + 1 > s -> size) {
+		s -> size *= 2;
+		s -> output = realloc(s -> output, s -> size);
+	    }
+	    ssize_t k = read(s -> fd, s -> output + s -> len, 4096);
+	    if ((k <= 0) && (errno != EAGAIN)) break; //EIO once the shell has exited
+	    if (k > 0) s -> len += k;
+	    s -> output[s -> len] = '\0';
+	    found = strstr(s -> output, marker);
+	}
+    }
+    free(pending);
+    if (found == NULL) return -1;
+    *found = '\0';
+    s -> len = found - s -> output;
+    return 0;
+}
+
+/*
+ * run_repeated
+ *
+ * Runs command count times, in batches of BATCH lines, and exits if the shell stops responding.
+ */
+void run_repeated(session *s, const char *command, const int count) {
+    size_t k = strlen(command);
+    char *batch = malloc((k + 1) * BATCH + 1);
+    for (int done = 0; done < count; ) {
+	int lines = (count - done < BATCH) ? count - done : BATCH;
+	char *c = batch;
+	for (int i = 0; i < lines; ++i, c += k + 1) sprintf(c, "%s\n", command);
+	if (run(s, batch) == -1) {
+	    printf("harness: the shell stopped responding after %d times %s\n", done, command);
+	    exit(1);
+	}
+	done += lines;
+    }
+    free(batch);
+}
+
+/*
+ * count_children
+ *
+ * Counts the processes whose parent is parent, and how many of them are zombies, from /proc.
+ * The echo printing the last marker may not have exited yet when its output is read, so the
+ * count is repeated for up to a second until no children are left.
+ */
+void count_children(const pid_t parent, int *children, int *zombies) {
+    for (int tries = 0; tries < 50; ++tries) {
+	if (tries > 0) usleep(20000);
+	scan_children(parent, children, zombies);
+	if (*children == 0) return;
+    }
+}
+
+/*
+ * scan_children
+ *
+ * Counts the processes whose parent is parent in /proc once, and how many of them are zombies.
+ */
+void scan_children(const pid_t parent, int *children, int *zombies) {
+    *children = 0;
+    *zombies = 0;
+    DIR *proc = opendir("/proc");
+    if (proc == NULL) return;
+    struct dirent *entry;
+    while ((entry = readdir(proc)) != NULL) {
+	char name[64], buf[512];
+	int pid = atoi(entry -> d_name);
+	if (pid <= 0) continue;
+	snprintf(name, sizeof(name), "/proc/%d/stat", pid);
+	FILE *f = fopen(name, "r");
+	if (f == NULL) continue;
+	size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+
+	//the command name is in parentheses and can hold spaces, the state and ppid follow the last )
+	char *c = strrchr(buf, ')');
+	char state;
+	int ppid;
+	if ((c == NULL) || (sscanf(c + 1, " %c %d", &state, &ppid) != 2) || (ppid != parent)) continue;
+	++*children;
+	if (state == 'Z') ++*zombies;
+    }
+    closedir(proc);
+}
+
+/*
+ * cpu_ticks
+ *
+ * Returns the user and system time of pid in clock ticks, from /proc, or -1.
+ */
+long cpu_ticks(const pid_t pid) {
+    char name[64], buf[1024];
+    snprintf(name, sizeof(name), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(name, "r");
+    if (f == NULL) return -1;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    //utime and stime are the 12th and 13th fields after the command name
+    char *c = strrchr(buf, ')');
+    long utime, stime;
+    if ((c == NULL) || (sscanf(c + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %ld %ld", &utime, &stime) != 2)) return -1;
+    return utime + stime;
+}
+
+/*
+ * count_fds
+ *
+ * Returns the number of open file descriptors of pid, from /proc, or -1.
+ */
+int count_fds(const pid_t pid) {
+    char name[64];
+    snprintf(name, sizeof(name), "/proc/%d/fd", (int)pid);
+    DIR *dir = opendir(name);
+    if (dir == NULL) return -1;
+    int fds = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+	if (entry -> d_name[0] != '.') ++fds;
+    }
+    closedir(dir);
+    return fds;
+}
+
+/*
+ * check_jobs
+ *
+ * Runs bglist -c and sets jobs to the number of background jobs it reports.
+ * Returns 1 if the shell found its job table consistent, 0 otherwise.
+ */
+int check_jobs(session *s, int *jobs) {
+    *jobs = -1;
+    if (run(s, "bglist -c\n") == -1) return 0;
+    char *line = strstr(s -> output, "bglist: ");
+    if (line == NULL) return 0;
+    char verdict[32];
+    if (sscanf(line, "bglist: %31[^,], %d jobs", verdict, jobs) != 2) return 0;
+    return !strcmp(verdict, "consistent");
+}
+
+/*
+ * wait_for_jobs
+ *
+ * Checks the job table until every background job has been reaped, for at most timeout seconds.
+ * Returns 1 if the jobs are gone and the table was consistent every time, 0 otherwise.
+ */
+int wait_for_jobs(session *s, const double timeout) {
+    double deadline = now() + timeout;
+    int jobs;
+    for (;;) {
+	if (!check_jobs(s, &jobs)) {
+	    printf("harness: bglist -c: %s", s -> output);
+	    return 0;
+	}
+	if (jobs == 0) return 1;
+	if (now() > deadline) return 0;
+	usleep(20000);
+    }
+}
+
+/*
+ * check
+ *
+ * Prints the result of a check and counts it if it failed.
+ */
+void check(const int ok, const char *what) {
+    printf("  %-44s %s\n", what, ok ? "ok" : "FAILED");
+    if (!ok) ++failures;
+}
+
+/*
+ * commands_per_second
+ *
+ * Measures how many commands per second the shell carries out at the prompt, for an external
+ * command, which is launched and waited for, and for a builtin.
+ */
+void commands_per_second(session *s) {
+    const char *commands[] = { "true", "cd ." };
+    for (int i = 0; i < 2; ++i) {
+	double start = now();
+	run_repeated(s, commands[i], CPS_COMMANDS);
+	double elapsed = now() - start;
+	printf("%-8s %6d commands in %7.3f s, %9.1f commands/s\n", commands[i], CPS_COMMANDS, elapsed, CPS_COMMANDS / elapsed);
+    }
+}
+
+/*
+ * spawn_storm
+ *
+ * Starts STORM_JOBS background jobs that exit at once, then checks that each was reaped and
+ * removed from the job table, and that the shell has no children or zombies left.
+ */
+void spawn_storm(session *s) {
+    printf("storm: %d background jobs\n", STORM_JOBS);
+    double start = now();
+    run_repeated(s, "bg true", STORM_JOBS);
+    double spawned = now() - start;
+    int reaped = wait_for_jobs(s, TIMEOUT);
+    double elapsed = now() - start;
+
+    int children, zombies;
+    count_children(s -> pid, &children, &zombies);
+    printf("  spawned in %.3f s (%.0f jobs/s), all reaped after %.3f s\n", spawned, STORM_JOBS / spawned, elapsed);
+    printf("  %d children, %d zombies left\n", children, zombies);
+    check(reaped, "every job reaped, job table consistent");
+    check((children == 0) && (zombies == 0), "no children or zombies left");
+}
+
+/*
+ * kill_soak
+ *
+ * For SOAK_ROUNDS rounds starts jobs that exit at once and jobs that keep running, lists them,
+ * kills every listed job while the short ones are exiting, and checks the job table after each
+ * round. Kills of jobs that are already gone are expected to fail. At the end every job must
+ * have been reaped, with no zombies left.
+ */
+void kill_soak(session *s) {
+    printf("soak: %d rounds of kill racing exiting jobs\n", SOAK_ROUNDS);
+    int started = 0, kills = 0, consistent = 0;
+    for (int round = 0; round < SOAK_ROUNDS; ++round) {
+	run(s, "bg true\nbg sleep 0.01\nbg sleep 30\nbg true\nbg sleep 0.02\nbg sleep 30\n");
+	started += 6;
+	if (run(s, "bglist\n") == -1) break;
+
+	//every listed job is killed with one kill command
+	char command[4096] = "kill";
+	size_t len = 4;
+	for (char *line = s -> output; line != NULL; line = strchr(line, '\n')) {
+	    while ((*line == '\n') || (*line == '\r')) ++line;
+	    int pid;
+	    char colon;
+	    if ((sscanf(line, "%d%c", &pid, &colon) != 2) || (colon != ':')) continue;
+	    char *end = strchr(line, '\n');
+	    char *started = strstr(line, "(started ");
+	    if ((started == NULL) || ((end != NULL) && (started > end))) continue; //a job that has terminated
+	    len += snprintf(command + len, sizeof(command) - len, " %d", pid);
+	    ++kills;
+	}
+	if (len > 4) {
+	    snprintf(command + len, sizeof(command) - len, "\n");
+	    run(s, command);
+	}
+
+	int jobs;
+	if (check_jobs(s, &jobs)) ++consistent;
+	else printf("  round %d: %s", round, s -> output);
+    }
+    int reaped = wait_for_jobs(s, TIMEOUT);
+
+    int children, zombies;
+    count_children(s -> pid, &children, &zombies);
+    printf("  %d jobs started, %d kills sent, %d/%d rounds consistent\n", started, kills, consistent, SOAK_ROUNDS);
+    printf("  %d children, %d zombies left\n", children, zombies);
+    check(consistent == SOAK_ROUNDS, "job table consistent after every round");
+    check(reaped, "every job reaped");
+    check((children == 0) && (zombies == 0), "no children or zombies left");
+}
+
+/*
+ * orphaned_capture
+ *
+ * Starts a captured job whose own process exits at once while a grandchild keeps its output
+ * pipes open for ORPHAN_SECONDS. Once the grandchild has exited as well, the shell must have
+ * closed the pipes and stay idle at the prompt rather than spin on their end of file.
+ */
+void orphaned_capture(session *s) {
+    printf("orphan: captured job whose grandchild holds its pipes for %d s\n", ORPHAN_SECONDS);
+    int fds = count_fds(s -> pid);
+    char command[128];
+    snprintf(command, sizeof(command), "bg --capture sh -c \"sleep %d &\"\n", ORPHAN_SECONDS);
+    run(s, command);
+    int reaped = wait_for_jobs(s, TIMEOUT);
+
+    //the end of file on the pipes arrives once the grandchild exits, the shell is then watched
+    //waiting at the prompt for half a second
+    usleep(ORPHAN_SECONDS * 1000000 + 200000);
+    long ticks = cpu_ticks(s -> pid);
+    usleep(500000);
+    ticks = cpu_ticks(s -> pid) - ticks;
+    long limit = sysconf(_SC_CLK_TCK) / 10; //a fifth of the time waited
+
+    run(s, "");
+    int left = count_fds(s -> pid) - fds;
+    printf("  %ld cpu ticks in 0.5 s at the prompt, %d more fds open after the grandchild exited\n", ticks, left);
+    check(reaped, "the job reaped");
+    check((ticks >= 0) && (ticks <= limit), "shell idle after the grandchild exited");
+    check(left <= 0, "pipes closed after the grandchild exited");
+}
+
+/*
+ * spawn_reap
+ *
+ * Times STORM_JOBS background jobs that exit at once: how long the shell takes to start them
+ * from the prompt, and how long after the last one every job has been reaped and removed from
+ * the job table.
+ */
+void spawn_reap(session *s) {
+    double start = now();
+    run_repeated(s, "bg true", STORM_JOBS);
+    double spawned = now() - start;
+    if (!wait_for_jobs(s, TIMEOUT)) {
+	printf("harness: the background jobs were not all reaped\n");
+	++failures;
+	return;
+    }
+    double elapsed = now() - start;
+    printf("bg true  %6d jobs spawned in %7.3f s, %9.1f jobs/s, all reaped %.3f s later, %9.1f jobs/s overall\n",
+	   STORM_JOBS, spawned, STORM_JOBS / spawned, elapsed - spawned, STORM_JOBS / elapsed);
+}
+
+/*
+ * moved_command
+ *
+ * Starts the shell argv with --fork and a PATH of two directories of its own, runs a command from
+ * the first, which puts it in the command cache, then moves it to the second and runs it again.
+ * The cached location is stale by then; the child of fork cannot report that to the shell, so
+ * the shell has to notice before forking and search PATH again.
+ */
+void moved_command(char **argv) {
+    printf("moved: a cached command moved to another PATH directory, with --fork\n");
+    char first[64], second[64], from[96], to[96];
+    snprintf(first, sizeof(first), "/tmp/ssi-harness-%d-a", (int)getpid());
+    snprintf(second, sizeof(second), "/tmp/ssi-harness-%d-b", (int)getpid());
+    snprintf(from, sizeof(from), "%s/harness-moved", first);
+    snprintf(to, sizeof(to), "%s/harness-moved", second);
+    mkdir(first, 0755);
+    mkdir(second, 0755);
+    FILE *f = fopen(from, "w");
+    if (f != NULL) {
+	fprintf(f, "#!/bin/sh\necho moved-ran\n");
+	fclose(f);
+    }
+    chmod(from, 0755);
+
+    const char *path_env = getenv("PATH");
+    char *saved = strdup((path_env != NULL) ? path_env : "/usr/bin:/bin");
+    char *path = malloc(strlen(first) + strlen(second) + strlen(saved) + 3);
+    sprintf(path, "%s:%s:%s", first, second, saved);
+    setenv("PATH", path, 1);
+
+    int argc = 0;
+    while (argv[argc] != NULL) ++argc;
+    char **forked = malloc(sizeof(char*) * (argc + 2));
+    memcpy(forked, argv, sizeof(char*) * argc);
+    forked[argc] = "--fork";
+    forked[argc + 1] = NULL;
+
+    session s;
+    start_session(&s, forked);
+    int ran = (run(&s, "harness-moved\n") == 0) && (strstr(s.output, "moved-ran") != NULL);
+    rename(from, to);
+    int moved = (run(&s, "harness-moved\n") == 0) && (strstr(s.output, "moved-ran") != NULL);
+    int again = (run(&s, "harness-moved\n") == 0) && (strstr(s.output, "moved-ran") != NULL);
+    end_session(&s);
+
+    setenv("PATH", saved, 1);
+    unlink(to);
+    rmdir(first);
+    rmdir(second);
+    free(forked);
+    free(path);
+    free(saved);
+    check(ran, "the command ran from the first directory");
+    check(moved && again, "found in the second after it moved");
+}
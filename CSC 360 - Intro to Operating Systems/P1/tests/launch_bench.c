@@ -0,0 +1,69 @@
+/*
+ *  CSC360 Assignment 1 - launch latency benchmark
+ *  Measures how long ssi takes to launch a command as the shell's heap grows, with posix_spawn
+ *  and with fork. fork copies the page tables of the whole heap while posix_spawn does not, so
+ *  the gap between them widens with the heap. The shell is built into this program, its main
+ *  renamed, so commands are launched by the same launch_pipeline as at the prompt.
+ *
+ *  usage: launch_bench [runs] [heap MB...]
+ */
+
+#define main ssi_main
+#include "../ssi.c"
+#undef main
+
+#define LAUNCH_RUNS 300
+
+int main(int argc, char **argv) {
+    int runs = (argc > 1) ? atoi(argv[1]) : LAUNCH_RUNS;
+    const char *default_sizes[] = { "0", "64", "256", "1024" };
+    const char **sizes = (argc > 2) ? (const char**)argv + 2 : default_sizes;
+    int num_sizes = (argc > 2) ? argc - 2 : 4;
+    if (runs < 1) {
+	fprintf(stderr, "usage: launch_bench [runs] [heap MB...]\n");
+	return 2;
+    }
+
+    char *cmd[] = { "true", NULL };
+    double *spawn = malloc(sizeof(double) * runs);
+    double *wall = malloc(sizeof(double) * runs);
+    printf("launch: %d runs of %s at each heap size, the time to launch and until reaped\n", runs, cmd[0]);
+
+    for (int i = 0; i < num_sizes; ++i) {
+	size_t bytes = (size_t)atoi(sizes[i]) << 20;
+	char *heap = NULL;
+	if (bytes > 0) {
+	    //touched, so its pages are mapped and fork has to copy their page table entries
+	    heap = malloc(bytes);
+	    if (heap == NULL) {
+		fprintf(stderr, "launch_bench: cannot allocate %s MB\n", sizes[i]);
+		return 1;
+	    }
+	    memset(heap, 1, bytes);
+	}
+	printf("heap %s MB\n%-8s%12s%12s%12s%12s\n", sizes[i], "ms", "p50", "p90", "p99", "mean");
+
+	for (launch_with_fork = 0; launch_with_fork < 2; ++launch_with_fork) {
+	    for (int run = 0; run < runs; ++run) {
+		struct timespec before;
+		clock_gettime(CLOCK_MONOTONIC, &before);
+		pid_t pid;
+		launch_pipeline(cmd, &pid, NULL, NULL, NULL, GROUP_SHELL, NULL);
+		spawn[run] = elapsed_seconds(&before);
+		int status;
+		if ((pid <= 0) || (waitpid(pid, &status, 0) == -1)) {
+		    fprintf(stderr, "launch_bench: %s could not be launched\n", cmd[0]);
+		    return 1;
+		}
+		wall[run] = elapsed_seconds(&before);
+	    }
+
+	    print_bench_row(launch_with_fork ? "fork" : "spawn", spawn, runs);
+	    print_bench_row("  wall", wall, runs);
+	}
+	free(heap);
+    }
+    free(spawn);
+    free(wall);
+    return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ *  CSC360 Assignment 1 - parse benchmark
+ *  Measures how long ssi takes to turn a command line into argv: the line is copied into the
+ *  line arena and parsed by parse_input, variables and quotes included, as at the prompt.
+ *  The shell is built into this program, its main renamed.
+ *
+ *  usage: parse_bench [iterations]
+ */
+
+#define main ssi_main
+#include "../ssi.c"
+#undef main
+
+#define PARSE_ITERATIONS 100000
+
+int main(int argc, char **argv) {
+    int iterations = (argc > 1) ? atoi(argv[1]) : PARSE_ITERATIONS;
+    if (iterations < 1) {
+	fprintf(stderr, "usage: parse_bench [iterations]\n");
+	return 2;
+    }
+    setenv("PARSE_BENCH", "value", 1);
+
+    char long_line[ARG_MAX];
+    size_t len = 0;
+    for (int i = 0; len + 16 < sizeof(long_line); ++i) len += snprintf(long_line + len, sizeof(long_line) - len, "word%d ", i);
+    const char *lines[] = {
+	"ls -l /tmp",
+	"cat < in.txt | grep -v foo | sort -n >> out.txt",
+	"bg --nice=5 --capture make -j4 all",
+	"echo $PARSE_BENCH ${PARSE_BENCH} $? \"quoted $PARSE_BENCH\" 'single' a\\ b",
+	long_line
+    };
+    const char *names[] = { "simple", "pipeline", "bg", "expand", "long" };
+
+    arena mem;
+    init_arena(&mem, ARENA_SIZE);
+    printf("parse: %d iterations of each line\n", iterations);
+    printf("%-10s%8s%10s%12s%12s\n", "line", "bytes", "args", "ns/line", "MB/s");
+    for (int i = 0; i < 5; ++i) {
+	size_t k = strlen(lines[i]);
+	int args = 0;
+	struct timespec before;
+	clock_gettime(CLOCK_MONOTONIC, &before);
+	for (int n = 0; n < iterations; ++n) {
+	    //as in the prompt loop: the arena is reset and the line copied in, as it is parsed in place
+	    reset_arena(&mem);
+	    char *line = arena_alloc(&mem, k + 1);
+	    memcpy(line, lines[i], k + 1);
+	    char **parsed = parse_input(line, &mem);
+	    if (n == 0) for (args = 0; parsed[args] != NULL; ++args);
+	}
+	double seconds = elapsed_seconds(&before);
+	printf("%-10s%8zu%10d%12.1f%12.1f\n", names[i], k, args, seconds / iterations * 1e9, k * (double)iterations / seconds / 1e6);
+    }
+    reset_arena(&mem);
+    free(mem.base);
+    return 0;
+}